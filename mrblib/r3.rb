@@ -58,8 +58,4 @@ module R3
     when PATCH   then 'PATCH'
     end
   end
-
-  class Tree
-    attr_reader :routes
-  end
 end
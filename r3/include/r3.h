@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 
 #ifdef HAVE_PCRE_H
@@ -38,9 +39,21 @@ extern "C" {
 struct _edge;
 struct _node;
 struct _route;
+struct _flat;
+struct _cidr;
+struct _vhost;
+struct _regex;
+struct _arena;
+struct _pool;
 typedef struct _edge R3Edge;
 typedef struct _node R3Node;
 typedef struct _R3Route R3Route;
+typedef struct _flat R3Flat;
+typedef struct _cidr R3Cidr;
+typedef struct _vhost R3Vhost;
+typedef struct _regex R3Regex;
+typedef struct _arena R3Arena;
+typedef struct _pool R3Pool;
 
 struct _node  {
     R3_VECTOR(R3Edge) edges;
@@ -48,7 +61,10 @@ struct _node  {
     char * combined_pattern;
 #ifdef HAVE_PCRE_H
     pcre2_code * pcre_pattern;
-    pcre2_match_data * match_data;
+    unsigned int capture_count; // size the ovector of the match context
+    unsigned int pcre_jit;      // the pattern has jit code, see R3_COMPILE_JIT
+#else
+    R3Regex * regex_pattern;    // built-in engine for the combined pattern
 #endif
 
     // edges are mostly less than 255
@@ -57,8 +73,29 @@ struct _node  {
 
     // the pointer of R3Route data
     void * data;
+
+    // frozen copy of the subtree for matching, set by r3_tree_compile
+    R3Flat * flat;
+
+    // indexes of the address and host routes, set by r3_tree_compile
+    R3Cidr * cidr;
+    R3Vhost * vhost;
+
+    // changes since the last compile, see R3_DIRTY_NODE
+    unsigned int dirty;
+
+    // the node was put between the halves of an edge by r3_edge_branch
+    unsigned int branch;
+
+    // allocator of the nodes, edges and routes of the tree, see arena.h
+    R3Arena * arena;
 };
 
+// the edges or routes of the node changed, its patterns are compiled again
+#define R3_DIRTY_NODE 1
+// a node in the subtree changed, compile has to descend
+#define R3_DIRTY_TREE 2
+
 #define r3_node_edge_pattern(node,i) node->edges.entries[i].pattern.base
 #define r3_node_edge_pattern_len(node,i) node->edges.entries[i].pattern.len
 
@@ -67,6 +104,7 @@ struct _edge {
     R3Node * child; // 8 bytes
     unsigned int opcode; // 4byte
     unsigned int has_slug; // 4byte
+    unsigned short min, max; // length bounds of the opcode span, max 0 for none
 };
 
 struct _R3Route {
@@ -87,8 +125,32 @@ struct _R3Route {
 
     int          http_scheme;   // can be (SCHEME_HTTP or SCHEME_HTTPS)
 
+    unsigned int serial;        // order of insertion into the tree
+
 };
 
+/**
+ * Bound on the edges followed from the root by one match of a compiled
+ * tree, deeper subtrees fail to match.
+ */
+#ifndef R3_MATCH_DEPTH
+#define R3_MATCH_DEPTH 64
+#endif
+
+/**
+ * One level of the traversal of r3_flat_matchl: the node, the rest of the
+ * path and the next edge to try.
+ */
+typedef struct {
+    const char * path;
+    unsigned int path_len;
+    uint32_t node;          // flat node index
+    uint32_t edge;          // offset of the next edge in the node
+    unsigned int vars;      // captures to keep when an edge fails
+    unsigned int is_end;
+    unsigned int fallback;  // the node is returned if its subtree fails
+} r3_match_frame;
+
 typedef struct _R3Entry match_entry;
 struct _R3Entry {
     str_array vars;
@@ -100,13 +162,36 @@ struct _R3Entry {
     r3_iovec_t host; // the request host
     r3_iovec_t remote_addr;
 
+    // remote_addr parsed once per entry, see match_entry_remote_addr
+    int remote_addr_family;
+    uint32_t remote_addr_ip[4];
+
     int          http_scheme;
+
+    // set by r3_tree_matchl if the path was rejected by the filter of the tree
+    unsigned int rejected;
+
+    // per-call scratch space, owned by the caller so that a compiled tree
+    // stays read-only while matching
+#ifdef HAVE_PCRE_H
+    pcre2_match_data * match_data;
+    pcre2_match_context * match_context;
+    pcre2_jit_stack * jit_stack;
+#endif
+    void * scratch;
+    unsigned int scratch_size;
+
+    // traversal stack, left uninitialized by match_entry_initl
+    r3_match_frame stack[R3_MATCH_DEPTH];
 };
 
 
 R3Node * r3_tree_create(int cap);
 
-// R3Node * r3_node_create();
+/**
+ * Create a node in the arena of a tree, it is freed with the tree.
+ */
+R3Node * r3_node_create(R3Arena * arena, int cap);
 
 void r3_tree_free(R3Node * tree);
 
@@ -128,6 +213,10 @@ R3Node * r3_tree_insert_pathl(R3Node *tree, const char *path, int path_len, void
 
 R3Route * r3_tree_insert_routel(R3Node * tree, int method, const char *path, int path_len, void *data);
 
+/**
+ * Insert a route. The path is copied into the string pool of the tree, so
+ * the caller's string may go away after the call.
+ */
 R3Route * r3_tree_insert_routel_ex(R3Node * tree, int method, const char *path, int path_len, void *data, char **errstr);
 
 #define r3_tree_insert_routel(n, method, path, path_len, data) r3_tree_insert_routel_ex(n, method, path, path_len, data, NULL)
@@ -136,12 +225,24 @@ R3Route * r3_tree_insert_routel_ex(R3Node * tree, int method, const char *path,
 
 #define r3_tree_insert_route(n,method,path,data) r3_tree_insert_routel(n, method, path, strlen(path), data)
 
+int r3_tree_delete_routel_ex(R3Node * tree, int method, const char *path, int path_len, char **errstr);
+
+#define r3_tree_delete_routel(n, method, path, path_len) r3_tree_delete_routel_ex(n, method, path, path_len, NULL)
+
+#define r3_tree_delete_route(n,method,path) r3_tree_delete_routel(n, method, path, strlen(path))
+
 
 /**
  * The private API to insert a path
  */
 R3Node * r3_tree_insert_pathl_ex(R3Node *tree, const char *path, unsigned int path_len, int method, unsigned int router, void * data, char **errstr);
 
+/**
+ * Copy the string into the pool of the tree, equal strings are stored once.
+ * The copy is null-terminated and lives as long as the tree.
+ */
+const char * r3_tree_intern(R3Node * tree, const char * str, unsigned int len);
+
 void r3_tree_dump(const R3Node * n, int level);
 
 
@@ -150,6 +251,12 @@ R3Edge * r3_node_find_edge_str(const R3Node * n, const char * str, int str_len);
 
 int r3_tree_compile(R3Node *n, char** errstr);
 
+// flags for r3_tree_compile_ex
+#define R3_COMPILE_DFA 1    // match with one automaton for the whole tree if possible
+#define R3_COMPILE_JIT 2    // jit compile the combined patterns if PCRE2 supports it
+
+int r3_tree_compile_ex(R3Node *n, int flags, char** errstr);
+
 int r3_tree_compile_patterns(R3Node * n, char** errstr);
 
 R3Node * r3_tree_matchl(const R3Node * n, const char * path, unsigned int path_len, match_entry * entry);
@@ -180,12 +287,21 @@ R3Route * r3_route_create(const char * path);
 
 R3Route * r3_node_append_route(R3Node *tree, const char * path, int path_len, int method, void *data);
 
-void r3_route_free(R3Route * route);
-
 int r3_route_cmp(const R3Route *r1, const match_entry *r2);
 
 R3Route * r3_tree_match_route(const R3Node *n, match_entry * entry);
 
+/**
+ * The second half of r3_tree_match_route: pick the first route of the
+ * endpoint n which accepts the entry. n may be NULL.
+ */
+R3Route * r3_node_match_route(const R3Node *n, match_entry * entry);
+
+/**
+ * Call fn for each route of the tree (depth first).
+ */
+void r3_tree_each_route(const R3Node *n, void (*fn)(R3Route *route, void *udata), void *udata);
+
 #define r3_route_create(p) r3_route_createl(p, strlen(p))
 
 
@@ -203,10 +319,24 @@ R3Route * r3_tree_match_route(const R3Node *n, match_entry * entry);
 
 int r3_pattern_to_opcode(const char * pattern, unsigned int len);
 
+/**
+ * Same as r3_pattern_to_opcode, also returns the length bounds of the
+ * span, e.g. 4 and 4 for \d{4}. A max of 0 means unbounded.
+ */
+int r3_pattern_to_opcode_ex(const char * pattern, unsigned int len, unsigned int * min, unsigned int * max);
+
 enum { NODE_COMPARE_STR, NODE_COMPARE_PCRE, NODE_COMPARE_OPCODE };
 
 enum { OP_EXPECT_MORE_DIGITS = 1, OP_EXPECT_MORE_WORDS, OP_EXPECT_NOSLASH,
-       OP_EXPECT_NODASH, OP_EXPECT_MORE_ALPHA, OP_GREEDY_ANY};
+       OP_EXPECT_NODASH, OP_EXPECT_MORE_ALPHA, OP_GREEDY_ANY,
+       OP_EXPECT_HEX,       // [0-9a-f]
+       OP_EXPECT_XDIGIT,    // [0-9a-fA-F]
+       OP_EXPECT_IDENT,     // [A-Za-z0-9_-]
+       OP_EXPECT_UUID,      // 8-4-4-4-12 digits of [0-9a-f]
+       OP_EXPECT_XUUID };   // 8-4-4-4-12 digits of [0-9a-fA-F]
+
+// upper bound for {n,m} quantifiers of opcodes, larger ones use the regex
+#define R3_OPCODE_MAX_REPEAT 1024
 
 
 
@@ -216,6 +346,28 @@ match_entry * match_entry_createl(const char * path, int path_len);
 
 void match_entry_free(match_entry * entry);
 
+/**
+ * Initialize and release a caller allocated entry, e.g. one on the stack.
+ */
+void match_entry_initl(match_entry * entry, const char * path, int path_len);
+
+void match_entry_release(match_entry * entry);
+
+#ifdef HAVE_PCRE_H
+pcre2_match_data * match_entry_pcre_data(match_entry * entry, uint32_t pairs);
+
+pcre2_match_context * match_entry_pcre_context(match_entry * entry);
+#endif
+
+void * match_entry_scratch(match_entry * entry, unsigned int size);
+
+/**
+ * Parse the remote_addr of the entry on the first call, the result is kept
+ * in the entry. Returns 4 or 6 for the IP version, or -1 if remote_addr is
+ * not an address.
+ */
+int match_entry_remote_addr(match_entry * entry);
+
 
 
 
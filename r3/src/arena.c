@@ -0,0 +1,160 @@
+/*
+ * arena.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "r3.h"
+#include "arena.h"
+
+#define r3_arena_base(c) ((uintptr_t)((c) + 1))
+
+R3Arena * r3_arena_create(void) {
+    R3Arena * arena = r3_mem_alloc(sizeof(R3Arena));
+    memset(arena, 0, sizeof(*arena));
+    return arena;
+}
+
+void r3_arena_free(R3Arena * arena) {
+    R3ArenaChunk * c, * next;
+
+    if (!arena) {
+        return;
+    }
+    for (c = arena->chunks; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+    free(arena);
+}
+
+static R3ArenaChunk * r3_arena_chunk_create(R3Arena * arena, size_t size) {
+    R3ArenaChunk * c = malloc(sizeof(R3ArenaChunk) + size);
+
+    if (!c) {
+        r3_fatal("no memory");
+    }
+    c->size = size;
+    c->used = 0;
+
+    arena->chunks_len++;
+    arena->size += size;
+    return c;
+}
+
+/**
+ * Carve size bytes out of the chunk, or return NULL if they do not fit.
+ */
+static void * r3_arena_bump(R3ArenaChunk * c, size_t size, size_t align) {
+    uintptr_t base = r3_arena_base(c);
+    uintptr_t p = (base + c->used + align - 1) & ~(uintptr_t)(align - 1);
+
+    if (p + size > base + c->size) {
+        return NULL;
+    }
+    c->used = p + size - base;
+    return (void *)p;
+}
+
+static void * r3_arena_alloc_aligned(R3Arena * arena, size_t size, size_t align) {
+    R3ArenaChunk * c = arena->chunks;
+    size_t chunk_size;
+    void * p;
+
+    if (!c || !(p = r3_arena_bump(c, size, align))) {
+        chunk_size = c ? c->size * 2 : R3_ARENA_CHUNK_MIN;
+        if (chunk_size > R3_ARENA_CHUNK_MAX) {
+            chunk_size = R3_ARENA_CHUNK_MAX;
+        }
+
+        if (c && size + align > chunk_size) {
+            // a block larger than a chunk gets one of its own behind the
+            // current chunk, which is still used for the next blocks
+            R3ArenaChunk * big = r3_arena_chunk_create(arena, size + align);
+            big->next = c->next;
+            c->next = big;
+            c = big;
+        } else {
+            if (size + align > chunk_size) {
+                chunk_size = size + align;
+            }
+            c = r3_arena_chunk_create(arena, chunk_size);
+            c->next = arena->chunks;
+            arena->chunks = c;
+        }
+        p = r3_arena_bump(c, size, align);
+    }
+
+    arena->used += size;
+    if (arena->used > arena->peak) {
+        arena->peak = arena->used;
+    }
+    return p;
+}
+
+void * r3_arena_alloc(R3Arena * arena, size_t size) {
+    return r3_arena_alloc_aligned(arena, size, R3_ARENA_ALIGN);
+}
+
+/**
+ * Return 1 if the block is the last one of the current chunk.
+ */
+static int r3_arena_is_last(const R3Arena * arena, const void * p, size_t size) {
+    const R3ArenaChunk * c = arena->chunks;
+    return c && (uintptr_t)p + size == r3_arena_base(c) + c->used;
+}
+
+void * r3_arena_grow(R3Arena * arena, void * p, size_t old_size, size_t new_size) {
+    R3ArenaChunk * c = arena->chunks;
+    void * q;
+
+    if (p && r3_arena_is_last(arena, p, old_size)
+            && (uintptr_t)p + new_size <= r3_arena_base(c) + c->size) {
+        c->used += new_size - old_size;
+        arena->used += new_size - old_size;
+        if (arena->used > arena->peak) {
+            arena->peak = arena->used;
+        }
+        return p;
+    }
+
+    q = r3_arena_alloc(arena, new_size);
+    if (p) {
+        memcpy(q, p, old_size);
+        r3_arena_release(arena, p, old_size);
+    }
+    return q;
+}
+
+void r3_arena_release(R3Arena * arena, void * p, size_t size) {
+    if (!p) {
+        return;
+    }
+    if (r3_arena_is_last(arena, p, size)) {
+        arena->chunks->used = (uintptr_t)p - r3_arena_base(arena->chunks);
+    }
+    arena->used -= size;
+}
+
+char * r3_arena_strndup(R3Arena * arena, const char * str, size_t len) {
+    char * s = r3_arena_alloc_aligned(arena, len + 1, 1);
+    memcpy(s, str, len);
+    s[len] = '\0';
+    return s;
+}
+
+void r3_arena_vector__expand(R3Arena * arena, r3_vector_t * vector, unsigned int element_size, unsigned int new_capacity) {
+    unsigned int capacity = vector->capacity;
+
+    // the first block fits, most nodes never grow
+    if (!vector->capacity) {
+        vector->capacity = new_capacity;
+    }
+    while (vector->capacity < new_capacity) {
+        vector->capacity *= 2;
+    }
+    vector->entries = r3_arena_grow(arena, vector->entries,
+        (size_t)element_size * capacity, (size_t)element_size * vector->capacity);
+}
@@ -0,0 +1,95 @@
+/*
+ * arena.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_ARENA_H
+#define R3_ARENA_H
+
+#include <stddef.h>
+#include "r3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// size of the first chunk, the following ones double up to the max
+#ifndef R3_ARENA_CHUNK_MIN
+#define R3_ARENA_CHUNK_MIN 4096
+#endif
+#ifndef R3_ARENA_CHUNK_MAX
+#define R3_ARENA_CHUNK_MAX (16 << 20)
+#endif
+
+// alignment of the blocks, strings are not aligned
+#define R3_ARENA_ALIGN 16
+
+typedef struct _arena_chunk {
+    struct _arena_chunk * next;          // the previous chunk
+    size_t size;
+    size_t used;
+} R3ArenaChunk;
+
+/**
+ * Bump allocator of a tree. The nodes, the edges, the routes and the copied
+ * patterns of the tree are carved out of large chunks, which are freed
+ * together with the root node.
+ *
+ * Blocks can not be freed one by one. A block which is given back is only
+ * reused if it was the last one of the current chunk, e.g. a vector which
+ * grows, otherwise it stays until the tree is freed.
+ */
+struct _arena {
+    R3ArenaChunk * chunks;               // the current chunk first
+    const R3Node * root;                 // the node which owns the arena
+
+    unsigned long chunks_len;
+    size_t size;                         // bytes of all chunks
+    size_t used;                         // bytes of the blocks in use
+    size_t peak;                         // highest used
+
+    R3Pool * strings;                    // paths and hosts of the routes, see pool.h
+    unsigned int serial;                 // routes inserted so far, numbers them
+};
+
+R3Arena * r3_arena_create(void);
+
+void r3_arena_free(R3Arena * arena);
+
+void * r3_arena_alloc(R3Arena * arena, size_t size);
+
+/**
+ * Resize the block p of old_size bytes, in place if it is the last block
+ * of the current chunk. p may be NULL.
+ */
+void * r3_arena_grow(R3Arena * arena, void * p, size_t old_size, size_t new_size);
+
+/**
+ * Give back the block p of size bytes.
+ */
+void r3_arena_release(R3Arena * arena, void * p, size_t size);
+
+char * r3_arena_strndup(R3Arena * arena, const char * str, size_t len);
+
+/**
+ * Same as r3_vector_reserve, with the entries in the arena.
+ */
+#define r3_arena_vector_reserve(arena, vector, new_capacity)                                                        \
+    r3_arena_vector__reserve((arena), (r3_vector_t *)(void *)(vector), sizeof((vector)->entries[0]), (new_capacity))
+
+void r3_arena_vector__expand(R3Arena * arena, r3_vector_t * vector, unsigned int element_size, unsigned int new_capacity);
+
+static inline void r3_arena_vector__reserve(R3Arena * arena, r3_vector_t * vector, unsigned int element_size, unsigned int new_capacity) {
+    if (vector->capacity < new_capacity) {
+        r3_arena_vector__expand(arena, vector, element_size, new_capacity);
+    }
+}
+
+#define r3_arena_vector_release(arena, vector) \
+    r3_arena_release((arena), (vector)->entries, sizeof((vector)->entries[0]) * (vector)->capacity)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_ARENA_H */
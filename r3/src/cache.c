@@ -0,0 +1,182 @@
+/*
+ * cache.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "r3.h"
+#include "flat.h"
+#include "exact.h"
+#include "cache.h"
+
+// bytes of the cache per bucket of the hash table
+#define R3_CACHE_BUCKET_BYTES 256
+
+#define r3_cache_path(e) ((const char *)((e)->data + 2 * (e)->vars))
+
+static inline uint32_t r3_cache_hash(const char * path, unsigned int path_len, int method) {
+    return r3_exact_hash(path, path_len) ^ ((uint32_t) method * 16777619u);
+}
+
+static inline size_t r3_cache_entry_size(unsigned int path_len, unsigned int vars) {
+    return sizeof(R3CacheEntry) + sizeof(uint32_t) * 2 * vars + path_len;
+}
+
+R3Cache * r3_cache_create(size_t capacity) {
+    R3Cache * cache = r3_mem_alloc(sizeof(R3Cache));
+    uint32_t buckets = 16;
+
+    while (buckets < capacity / R3_CACHE_BUCKET_BYTES && buckets < (1u << 24)) {
+        buckets <<= 1;
+    }
+
+    memset(cache, 0, sizeof(R3Cache));
+    cache->buckets  = r3_mem_alloc(sizeof(R3CacheEntry *) * buckets);
+    cache->mask     = buckets - 1;
+    cache->capacity = capacity;
+    memset(cache->buckets, 0, sizeof(R3CacheEntry *) * buckets);
+    return cache;
+}
+
+void r3_cache_clear(R3Cache * cache) {
+    R3CacheEntry * e, * next;
+
+    for (e = cache->head; e; e = next) {
+        next = e->next;
+        free(e);
+    }
+    memset(cache->buckets, 0, sizeof(R3CacheEntry *) * (cache->mask + 1));
+    cache->head = cache->tail = NULL;
+    cache->entries = 0;
+    cache->size = 0;
+}
+
+void r3_cache_free(R3Cache * cache) {
+    if (!cache) {
+        return;
+    }
+    r3_cache_clear(cache);
+    free(cache->buckets);
+    free(cache);
+}
+
+static void r3_cache_unlink(R3Cache * cache, R3CacheEntry * e) {
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        cache->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        cache->tail = e->prev;
+    }
+}
+
+static void r3_cache_push(R3Cache * cache, R3CacheEntry * e) {
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = e;
+    } else {
+        cache->tail = e;
+    }
+    cache->head = e;
+}
+
+static void r3_cache_evict(R3Cache * cache) {
+    R3CacheEntry * e = cache->tail, ** it;
+
+    for (it = cache->buckets + (e->hash & cache->mask); *it != e; it = &(*it)->chain);
+    *it = e->chain;
+
+    r3_cache_unlink(cache, e);
+    cache->entries--;
+    cache->size -= r3_cache_entry_size(e->path_len, e->vars);
+    free(e);
+}
+
+static void r3_cache_insert(R3Cache * cache, uint32_t hash, const R3Node * node, const match_entry * entry) {
+    const char * path = entry->path.base;
+    unsigned int path_len = entry->path.len;
+    unsigned int i, vars = node ? entry->vars.tokens.size : 0;
+    size_t size = r3_cache_entry_size(path_len, vars);
+    R3CacheEntry * e, ** bucket;
+
+    // a single path may not take more than a fraction of the cache
+    if (size > cache->capacity / 8) {
+        return;
+    }
+    while (cache->size + size > cache->capacity) {
+        r3_cache_evict(cache);
+    }
+
+    e = r3_mem_alloc(size);
+    e->node     = node;
+    e->hash     = hash;
+    e->method   = entry->request_method;
+    e->path_len = path_len;
+    e->vars     = vars;
+
+    for (i = 0; i < vars; i++) {
+        e->data[2 * i]     = entry->vars.tokens.entries[i].base - path;
+        e->data[2 * i + 1] = entry->vars.tokens.entries[i].len;
+    }
+    if (path_len) {
+        memcpy((char *) r3_cache_path(e), path, path_len);
+    }
+
+    bucket   = cache->buckets + (hash & cache->mask);
+    e->chain = *bucket;
+    *bucket  = e;
+    r3_cache_push(cache, e);
+    cache->entries++;
+    cache->size += size;
+}
+
+R3Route * r3_cache_match_route(R3Cache * cache, const R3Node * tree, match_entry * entry) {
+    const char * path = entry->path.base;
+    unsigned int path_len = entry->path.len;
+    const R3Node * n;
+    R3CacheEntry * e;
+    uint32_t hash, i;
+
+    if (!tree->flat) {
+        return r3_tree_match_route(tree, entry);
+    }
+
+    hash = r3_cache_hash(path, path_len, entry->request_method);
+
+    for (e = cache->buckets[hash & cache->mask]; e; e = e->chain) {
+        if (e->hash == hash && e->method == entry->request_method && e->path_len == path_len
+                && !memcmp(r3_cache_path(e), path, path_len)) {
+            break;
+        }
+    }
+
+    if (e) {
+        cache->hits++;
+        if (e != cache->head) {
+            r3_cache_unlink(cache, e);
+            r3_cache_push(cache, e);
+        }
+
+        entry->vars.tokens.size = 0;
+        for (i = 0; i < e->vars; i++) {
+            str_array_append(&entry->vars, path + e->data[2 * i], e->data[2 * i + 1]);
+        }
+        return r3_node_match_route(e->node, entry);
+    }
+
+    cache->misses++;
+    n = r3_tree_match_entry(tree, entry);
+
+    // paths turned away by the filter would only push out the others
+    if (!entry->rejected) {
+        r3_cache_insert(cache, hash, n, entry);
+    }
+    return r3_node_match_route(n, entry);
+}
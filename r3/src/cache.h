@@ -0,0 +1,71 @@
+/*
+ * cache.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_CACHE_H
+#define R3_CACHE_H
+
+#include <stdint.h>
+#include "r3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _cache R3Cache;
+
+typedef struct _cache_entry {
+    struct _cache_entry * chain;         // next entry of the bucket
+    struct _cache_entry * prev, * next;  // LRU list, most recent first
+    const R3Node * node;                 // NULL if the path did not match
+    uint32_t hash;
+    int method;
+    unsigned int path_len;
+    unsigned int vars;
+    uint32_t data[];                     // offset and length per capture, then the path
+} R3CacheEntry;
+
+/**
+ * Results of r3_tree_matchl of a compiled tree by request method and path.
+ * The endpoint and the offsets of the captures are kept, the route is still
+ * picked per request so that host, scheme and address are checked. The
+ * entries take at most capacity bytes, the least recently used ones are
+ * dropped first.
+ *
+ * The cache points into the tree, it has to be cleared when routes are
+ * added or the tree is compiled again.
+ */
+struct _cache {
+    R3CacheEntry ** buckets;
+    uint32_t mask;                       // buckets - 1, a power of two minus one
+
+    R3CacheEntry * head, * tail;
+    unsigned int entries;
+    size_t size;                         // bytes of the entries
+    size_t capacity;
+
+    unsigned long hits, misses;
+};
+
+R3Cache * r3_cache_create(size_t capacity);
+
+void r3_cache_free(R3Cache * cache);
+
+/**
+ * Drop all entries, the counters are kept.
+ */
+void r3_cache_clear(R3Cache * cache);
+
+/**
+ * Same as r3_tree_match_route, but the walk through the tree is skipped if
+ * the method and path of the entry are cached. Trees which are not compiled
+ * are matched as usual.
+ */
+R3Route * r3_cache_match_route(R3Cache * cache, const R3Node * tree, match_entry * entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_CACHE_H */
@@ -0,0 +1,234 @@
+/*
+ * cidr.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+# ifdef __GNUC__
+#  if (_WIN32_WINNT < 0x0600)
+#   undef _WIN32_WINNT
+#   define _WIN32_WINNT 0x0600
+#  endif
+# endif
+# include <winsock2.h>
+# include <ws2tcpip.h>
+#else
+# include <arpa/inet.h>
+# include <netinet/in.h>
+#endif
+
+#include "r3.h"
+#include "cidr.h"
+
+int r3_addr_parse(const char * addr, unsigned int len, uint32_t ip[4]) {
+    char buf[64];
+    struct in_addr addr4;
+    struct in6_addr addr6;
+    int i;
+
+    if (!addr || len >= sizeof(buf)) {
+        return R3_ADDR_INVALID;
+    }
+
+    memcpy(buf, addr, len);
+    buf[len] = 0;
+
+    if (inet_pton(AF_INET, buf, (void *)&addr4) == 1) {
+        ip[0] = ntohl(addr4.s_addr);
+        ip[1] = ip[2] = ip[3] = 0;
+        return R3_ADDR_V4;
+    }
+
+    if (inet_pton(AF_INET6, buf, (void *)&addr6) == 1) {
+        for (i = 0; i < 4; i++) {
+            uint32_t word;
+            memcpy(&word, addr6.s6_addr + 4 * i, sizeof(word));
+            ip[i] = ntohl(word);
+        }
+        return R3_ADDR_V6;
+    }
+    return R3_ADDR_INVALID;
+}
+
+int r3_route_addr_match(const R3Route * route, int family, const uint32_t ip[4]) {
+    int i, bits;
+
+    if (route->remote_addr_v4_bits > 0) {
+        if (family != R3_ADDR_V4) {
+            return 0;
+        }
+
+        bits = 32 - route->remote_addr_v4_bits;
+        if (route->remote_addr_v4 >> bits != ip[0] >> bits) {
+            return 0;
+        }
+    }
+
+    if (route->remote_addr_v6_bits[0] > 0) {
+        if (family != R3_ADDR_V6) {
+            return 0;
+        }
+
+        for (i = 0; i < 4; i++) {
+            bits = 32 - route->remote_addr_v6_bits[i];
+            if (bits == 32) {
+                continue;
+            }
+            if (route->remote_addr_v6[i] >> bits != ip[i] >> bits) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+#define r3_addr_bit(words,i) (((words)[(i) >> 5] >> (31 - ((i) & 31))) & 1)
+
+/**
+ * Prefix of a route for the trie. Returns the root of its family, or -1 if
+ * the route has no prefix or one with gaps, like an IPv6 mask of 32/0/32.
+ */
+static int r3_route_prefix(const R3Route * route, const unsigned int ** words, unsigned int * bits) {
+    int i, done = 0;
+
+    if (route->remote_addr_v4_bits > 0 && route->remote_addr_v6_bits[0] <= 0) {
+        if (route->remote_addr_v4_bits > 32) {
+            return -1;
+        }
+        *words = &route->remote_addr_v4;
+        *bits  = route->remote_addr_v4_bits;
+        return 0;
+    }
+
+    if (route->remote_addr_v6_bits[0] > 0 && route->remote_addr_v4_bits <= 0) {
+        *words = route->remote_addr_v6;
+        *bits  = 0;
+
+        for (i = 0; i < 4; i++) {
+            int b = route->remote_addr_v6_bits[i];
+
+            if (b < 0 || b > 32 || (done && b)) {
+                return -1;
+            }
+            *bits += b;
+            done = b < 32;
+        }
+        return 1;
+    }
+    return -1;
+}
+
+R3Cidr * r3_cidr_create(const R3Node * n) {
+    R3_VECTOR(R3CidrNode) nodes = { NULL, 0, 0 };
+    const unsigned int * words;
+    unsigned int bits, b, indexed = 0;
+    uint32_t i, node;
+    R3Cidr * cidr;
+    int root;
+
+    for (i = 0; i < n->routes.size; i++) {
+        indexed += r3_route_prefix(n->routes.entries + i, &words, &bits) >= 0;
+    }
+    if (indexed < R3_CIDR_MIN) {
+        return NULL;
+    }
+
+    cidr = r3_mem_alloc(sizeof(R3Cidr));
+    cidr->next = r3_mem_alloc(sizeof(uint32_t) * n->routes.size);
+    cidr->others = r3_mem_alloc(sizeof(uint32_t) * n->routes.size);
+    cidr->others_len = 0;
+    cidr->routes_len = n->routes.size;
+
+    r3_vector_reserve(&nodes, 2);
+    memset(nodes.entries, 0, sizeof(R3CidrNode) * 2);
+    nodes.size = 2;
+
+    // the routes are chained in reverse, so that each chain is in order
+    for (i = n->routes.size; i-- > 0;) {
+        cidr->next[i] = 0;
+
+        if ((root = r3_route_prefix(n->routes.entries + i, &words, &bits)) < 0) {
+            continue;
+        }
+
+        for (node = root, b = 0; b < bits; b++) {
+            unsigned int bit = r3_addr_bit(words, b);
+
+            if (!nodes.entries[node].child[bit]) {
+                r3_vector_reserve(&nodes, nodes.size + 1);
+                memset(nodes.entries + nodes.size, 0, sizeof(R3CidrNode));
+                nodes.entries[node].child[bit] = nodes.size++;
+            }
+            node = nodes.entries[node].child[bit];
+        }
+
+        cidr->next[i] = nodes.entries[node].routes;
+        nodes.entries[node].routes = i + 1;
+    }
+
+    for (i = 0; i < n->routes.size; i++) {
+        if (r3_route_prefix(n->routes.entries + i, &words, &bits) < 0) {
+            cidr->others[cidr->others_len++] = i;
+        }
+    }
+
+    cidr->nodes = nodes.entries;
+    cidr->nodes_len = nodes.size;
+    return cidr;
+}
+
+void r3_cidr_free(R3Cidr * cidr) {
+    if (!cidr) {
+        return;
+    }
+    free(cidr->nodes);
+    free(cidr->next);
+    free(cidr->others);
+    free(cidr);
+}
+
+R3Route * r3_routes_match_merged(const R3Node * n, const uint32_t * hits, uint32_t hits_len,
+    const uint32_t * others, uint32_t others_len, match_entry * entry) {
+    uint32_t i = 0, j = 0, idx;
+    R3Route * route;
+
+    while (i < hits_len || j < others_len) {
+        if (j == others_len || (i < hits_len && hits[i] < others[j])) {
+            idx = hits[i++];
+        } else {
+            idx = others[j++];
+        }
+
+        route = n->routes.entries + idx;
+        if (r3_route_cmp(route, entry) == 0) {
+            return route;
+        }
+    }
+    return NULL;
+}
+
+R3Route * r3_cidr_match_route(const R3Cidr * cidr, const R3Node * n, match_entry * entry) {
+    uint32_t * hits = match_entry_scratch(entry, sizeof(uint32_t) * (cidr->routes_len + 1));
+    uint32_t hits_len = 0, node, r;
+    int family = match_entry_remote_addr(entry);
+    unsigned int b, bits;
+
+    // collect the routes of all prefixes which hold the address
+    if (family == R3_ADDR_V4 || family == R3_ADDR_V6) {
+        node = family == R3_ADDR_V4 ? 0 : 1;
+        bits = family == R3_ADDR_V4 ? 32 : 128;
+
+        for (b = 0; ; b++) {
+            for (r = cidr->nodes[node].routes; r; r = cidr->next[r - 1]) {
+                r3_routes_add_hit(hits, &hits_len, r - 1);
+            }
+            if (b == bits || !(node = cidr->nodes[node].child[r3_addr_bit(entry->remote_addr_ip, b)])) {
+                break;
+            }
+        }
+    }
+    return r3_routes_match_merged(n, hits, hits_len, cidr->others, cidr->others_len, entry);
+}
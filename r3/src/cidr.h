@@ -0,0 +1,103 @@
+/*
+ * cidr.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_CIDR_H
+#define R3_CIDR_H
+
+#include <stdint.h>
+#include "r3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// endpoints with at least this many address routes get a prefix trie
+#ifndef R3_CIDR_MIN
+#define R3_CIDR_MIN 8
+#endif
+
+#define R3_ADDR_INVALID -1
+#define R3_ADDR_V4 4
+#define R3_ADDR_V6 6
+
+typedef struct _cidr_node {
+    uint32_t child[2];       // 0 for none, the roots are never a child
+    uint32_t routes;         // first route of the prefix + 1, or 0
+} R3CidrNode;
+
+/**
+ * Binary trie over the address prefixes of the routes of one endpoint.
+ * Routes with the same prefix are chained in their order, routes without
+ * a usable prefix are kept aside and checked for every address.
+ */
+struct _cidr {
+    R3CidrNode * nodes;      // the IPv4 root first, then the IPv6 root
+    uint32_t nodes_len;
+    uint32_t * next;         // next route + 1 of the same prefix, per route
+
+    uint32_t * others;       // routes which are not in the trie, in order
+    uint32_t others_len;
+
+    uint32_t routes_len;     // routes of the endpoint at compile time
+};
+
+/**
+ * Parse an address like 10.0.0.1 or ::1 into words in host order, an IPv4
+ * address into the first one. Returns R3_ADDR_V4, R3_ADDR_V6 or
+ * R3_ADDR_INVALID.
+ */
+int r3_addr_parse(const char * addr, unsigned int len, uint32_t ip[4]);
+
+/**
+ * Return 1 if the route is restricted to an IPv4 or IPv6 prefix.
+ */
+static inline int r3_route_has_addr(const R3Route * route) {
+    return route->remote_addr_v4_bits > 0 || route->remote_addr_v6_bits[0] > 0;
+}
+
+/**
+ * Return 1 if the parsed address is within the prefixes of the route.
+ */
+int r3_route_addr_match(const R3Route * route, int family, const uint32_t ip[4]);
+
+/**
+ * Index the address routes of an endpoint. Returns NULL if it has less
+ * than R3_CIDR_MIN of them.
+ */
+R3Cidr * r3_cidr_create(const R3Node * n);
+
+void r3_cidr_free(R3Cidr * cidr);
+
+/**
+ * Same as the loop over the routes in r3_tree_match_route, but only the
+ * routes whose prefix holds the address of the entry are compared.
+ */
+R3Route * r3_cidr_match_route(const R3Cidr * cidr, const R3Node * n, match_entry * entry);
+
+/**
+ * Add a route index to a sorted list of candidates.
+ */
+static inline void r3_routes_add_hit(uint32_t * hits, uint32_t * hits_len, uint32_t idx) {
+    uint32_t k;
+
+    for (k = (*hits_len)++; k && hits[k - 1] > idx; k--) {
+        hits[k] = hits[k - 1];
+    }
+    hits[k] = idx;
+}
+
+/**
+ * Compare the candidates found by an index and the routes which are not
+ * indexed, both sorted, in the order of the routes of the endpoint. The
+ * first route which accepts the request wins.
+ */
+R3Route * r3_routes_match_merged(const R3Node * n, const uint32_t * hits, uint32_t hits_len,
+    const uint32_t * others, uint32_t others_len, match_entry * entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_CIDR_H */
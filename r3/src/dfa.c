@@ -0,0 +1,512 @@
+/*
+ * dfa.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "r3.h"
+#include "flat.h"
+#include "dfa.h"
+#include "r3_debug.h"
+
+/**
+ * Positions in the flat tree, the nfa states of the construction:
+ *
+ *   [0, nodes)                  the node was entered by a static edge
+ *   [nodes, nodes + bytes)      inside a static edge, before that byte
+ *   [spans, root)               after k bytes of the span of an opcode edge
+ *   root                        the root, before the first byte
+ *
+ * Opcode spans are possessive like in the flat matcher, a span is left
+ * only on a byte the opcode does not accept or once it has max bytes.
+ * Unbounded spans count up to their min length, then stay in place.
+ */
+typedef struct {
+    const R3Flat * flat;
+    uint32_t spans;          // first position of the opcode edges
+    uint32_t root;
+
+    uint32_t * span_pos;     // position of the first byte of each opcode edge
+    uint32_t * span_edge;    // opcode edge of each span position
+
+    uint32_t * byte_edge;    // edge of each byte in the pattern pool
+    uint32_t * seen;         // generation in which a position was added
+    uint32_t gen;
+
+    R3_VECTOR(uint32_t) pool;    // positions of all states
+    R3_VECTOR(uint32_t) offsets; // start of each state in the pool, plus the end
+    R3_VECTOR(uint32_t) next;    // state under construction
+    R3_VECTOR(uint32_t) trans;
+    R3_VECTOR(uint32_t) accept;
+
+    uint32_t * table;        // state + 1 by the hash of its positions
+    uint32_t table_size;
+} R3DfaBuilder;
+
+#define r3_dfa_push(v, x) do { \
+    r3_vector_reserve(&(v), (v).size + 1); \
+    (v).entries[(v).size++] = (x); \
+} while (0)
+
+static void r3_dfa_add(R3DfaBuilder * b, uint32_t pos) {
+    if (b->seen[pos] == b->gen) {
+        return;
+    }
+    b->seen[pos] = b->gen;
+    r3_dfa_push(b->next, pos);
+}
+
+/**
+ * Positions reached from node idx by the byte c, in the order of the
+ * flat matcher: the static edge first, then the slug edges.
+ */
+static void r3_dfa_step_node(R3DfaBuilder * b, uint32_t idx, unsigned char c) {
+    const R3Flat * flat = b->flat;
+    const R3FlatNode * n = flat->nodes + idx;
+    const R3FlatEdge * e = flat->edges + n->edges;
+    const R3FlatEdge * end = e + n->edges_len;
+
+    for (; e < end; e++) {
+        if (!e->has_slug) {
+            if (!e->pattern_len || (unsigned char) flat->bytes[e->pattern] != c) {
+                continue;
+            }
+            if (e->pattern_len > 1) {
+                r3_dfa_add(b, flat->nodes_len + e->pattern + 1);
+            } else if (e->child != R3_FLAT_NONE) {
+                r3_dfa_add(b, e->child);
+            }
+        } else if (r3_opcode_has(e->opcode, 0, c)) {
+            r3_dfa_add(b, b->span_pos[e - flat->edges]);
+        } else if (!e->min && e->child != R3_FLAT_NONE) {
+            // an empty slug
+            r3_dfa_step_node(b, e->child, c);
+        }
+    }
+}
+
+/**
+ * Number of positions of an opcode edge.
+ */
+static inline uint32_t r3_dfa_span_len(const R3FlatEdge * e) {
+    if (e->max) {
+        return e->max;
+    }
+    return e->min > 1 ? e->min : 1;
+}
+
+static void r3_dfa_step(R3DfaBuilder * b, uint32_t pos, unsigned char c) {
+    const R3Flat * flat = b->flat;
+    const R3FlatEdge * e;
+
+    if (pos < flat->nodes_len) {
+        r3_dfa_step_node(b, pos, c);
+    } else if (pos < b->spans) {
+        uint32_t off = pos - flat->nodes_len;
+
+        e = flat->edges + b->byte_edge[off];
+        if ((unsigned char) flat->bytes[off] != c) {
+            return;
+        }
+        if (off + 1 < e->pattern + e->pattern_len) {
+            r3_dfa_add(b, pos + 1);
+        } else if (e->child != R3_FLAT_NONE) {
+            r3_dfa_add(b, e->child);
+        }
+    } else if (pos < b->root) {
+        uint32_t idx = b->span_edge[pos - b->spans];
+        uint32_t k = pos - b->span_pos[idx] + 1;
+
+        e = flat->edges + idx;
+
+        if ((!e->max || k < e->max) && r3_opcode_has(e->opcode, k, c)) {
+            r3_dfa_add(b, k < r3_dfa_span_len(e) ? pos + 1 : pos);
+        } else if (k >= e->min && e->child != R3_FLAT_NONE) {
+            r3_dfa_step_node(b, e->child, c);
+        }
+    } else {
+        r3_dfa_step_node(b, 0, c);
+    }
+}
+
+static inline uint32_t r3_dfa_endpoint(const R3Flat * flat, uint32_t idx) {
+    return idx != R3_FLAT_NONE && flat->nodes[idx].endpoint ? idx : R3_FLAT_NONE;
+}
+
+/**
+ * Endpoint if the path ends at a position. A node entered by a static
+ * edge first tries its slugs which may be empty, then itself and then its
+ * catch-all slugs, the root only the slugs.
+ */
+static uint32_t r3_dfa_accept_pos(const R3DfaBuilder * b, uint32_t pos) {
+    const R3Flat * flat = b->flat;
+    const R3FlatNode * n;
+    const R3FlatEdge * e, * end;
+    uint32_t ret;
+
+    if (pos >= flat->nodes_len && pos < b->spans) {
+        return R3_FLAT_NONE;
+    }
+    if (pos >= b->spans && pos < b->root) {
+        uint32_t idx = b->span_edge[pos - b->spans];
+
+        e = flat->edges + idx;
+        return pos - b->span_pos[idx] + 1 >= e->min ? r3_dfa_endpoint(flat, e->child) : R3_FLAT_NONE;
+    }
+
+    n = flat->nodes + (pos == b->root ? 0 : pos);
+    e = flat->edges + n->edges;
+    end = e + n->edges_len;
+
+    for (; e < end; e++) {
+        if (pos != b->root && e->opcode == OP_GREEDY_ANY
+            && (ret = r3_dfa_endpoint(flat, pos)) != R3_FLAT_NONE) {
+            return ret;
+        }
+        if (e->has_slug && !e->min && (ret = r3_dfa_endpoint(flat, e->child)) != R3_FLAT_NONE) {
+            return ret;
+        }
+    }
+    return pos == b->root ? R3_FLAT_NONE : r3_dfa_endpoint(flat, pos);
+}
+
+static uint32_t r3_dfa_hash(const uint32_t * pos, unsigned int len) {
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h = (h ^ *pos++) * 16777619u;
+    }
+    return h;
+}
+
+static void r3_dfa_rehash(R3DfaBuilder * b) {
+    uint32_t size = b->table_size ? b->table_size * 2 : 64;
+    uint32_t mask = size - 1;
+    uint32_t s, i;
+
+    free(b->table);
+    b->table = r3_mem_alloc(sizeof(uint32_t) * size);
+    memset(b->table, 0, sizeof(uint32_t) * size);
+    b->table_size = size;
+
+    for (s = R3_DFA_START; s + 1 < b->offsets.size; s++) {
+        uint32_t off = b->offsets.entries[s];
+        uint32_t len = b->offsets.entries[s + 1] - off;
+
+        for (i = r3_dfa_hash(b->pool.entries + off, len) & mask; b->table[i]; i = (i + 1) & mask);
+        b->table[i] = s + 1;
+    }
+}
+
+/**
+ * Return the state of the positions in b->next, a new one if needed, or
+ * R3_FLAT_NONE if the automaton grew too large.
+ */
+static uint32_t r3_dfa_intern(R3DfaBuilder * b) {
+    uint32_t len = b->next.size;
+    uint32_t mask = b->table_size - 1;
+    uint32_t i, j, s, off, acc = R3_FLAT_NONE;
+
+    if (!len) {
+        return R3_DFA_DEAD;
+    }
+
+    for (i = r3_dfa_hash(b->next.entries, len) & mask; b->table[i]; i = (i + 1) & mask) {
+        s = b->table[i] - 1;
+        off = b->offsets.entries[s];
+
+        if (b->offsets.entries[s + 1] - off == len &&
+            !memcmp(b->pool.entries + off, b->next.entries, sizeof(uint32_t) * len)) {
+            return s;
+        }
+    }
+
+    s = b->offsets.size - 1;
+    if (s >= R3_DFA_MAX_STATES) {
+        return R3_FLAT_NONE;
+    }
+
+    // the first position which accepts wins, as in the flat matcher
+    for (j = 0; j < len && acc == R3_FLAT_NONE; j++) {
+        acc = r3_dfa_accept_pos(b, b->next.entries[j]);
+    }
+
+    r3_vector_reserve(&b->pool, b->pool.size + len);
+    memcpy(b->pool.entries + b->pool.size, b->next.entries, sizeof(uint32_t) * len);
+    b->pool.size += len;
+
+    r3_dfa_push(b->offsets, b->pool.size);
+    r3_dfa_push(b->accept, acc);
+
+    b->table[i] = s + 1;
+    if (2 * (s + 1) >= b->table_size) {
+        r3_dfa_rehash(b);
+    }
+    return s;
+}
+
+// bits of the opcodes and of the separator of UUIDs
+#define R3_DFA_KEYS (1 << (OP_EXPECT_XUUID + 1))
+
+/**
+ * Bytes which appear in static edges get a class of their own, the others
+ * are grouped by the opcodes accepting them. Returns the number of classes
+ * and stores one byte of each class in rep.
+ */
+static uint32_t r3_dfa_classes(const R3Flat * flat, uint8_t * classes, unsigned char * rep) {
+    uint16_t key_class[R3_DFA_KEYS + 256];
+    unsigned char is_static[256];
+    uint32_t i, len = 0;
+    unsigned int c, op;
+
+    memset(is_static, 0, sizeof(is_static));
+    memset(key_class, 0xFF, sizeof(key_class));
+
+    for (i = 0; i < flat->edges_len; i++) {
+        const R3FlatEdge * e = flat->edges + i;
+        uint32_t k;
+
+        for (k = 0; !e->has_slug && k < e->pattern_len; k++) {
+            is_static[(unsigned char) flat->bytes[e->pattern + k]] = 1;
+        }
+    }
+
+    for (c = 0; c < 256; c++) {
+        unsigned int key = 0;
+
+        if (is_static[c]) {
+            key = R3_DFA_KEYS + c;
+        } else {
+            for (op = OP_EXPECT_MORE_DIGITS; op <= OP_EXPECT_XUUID; op++) {
+                key |= r3_opcode_has(op, 0, c) << op;
+            }
+            key |= r3_opcode_has(OP_EXPECT_UUID, 8, c);
+        }
+
+        if (key_class[key] == 0xFFFF) {
+            key_class[key] = len;
+            rep[len++] = c;
+        }
+        classes[c] = key_class[key];
+    }
+    return len;
+}
+
+static void r3_dfa_builder_free(R3DfaBuilder * b) {
+    free(b->span_pos);
+    free(b->span_edge);
+    free(b->byte_edge);
+    free(b->seen);
+    free(b->pool.entries);
+    free(b->offsets.entries);
+    free(b->next.entries);
+    free(b->trans.entries);
+    free(b->accept.entries);
+    free(b->table);
+}
+
+/**
+ * Link each node to the edge leading to it, nodes follow their parent.
+ */
+static void r3_dfa_link(const R3Flat * flat, R3Dfa * dfa) {
+    uint32_t * depth = r3_mem_alloc(sizeof(uint32_t) * flat->nodes_len);
+    uint32_t i, j;
+
+    dfa->parent = r3_mem_alloc(sizeof(uint32_t) * 2 * flat->nodes_len);
+    dfa->parent[0] = dfa->parent[1] = R3_FLAT_NONE;
+    dfa->depth = depth[0] = 0;
+
+    for (i = 0; i < flat->nodes_len; i++) {
+        const R3FlatNode * n = flat->nodes + i;
+
+        for (j = n->edges; j < n->edges + n->edges_len; j++) {
+            uint32_t child = flat->edges[j].child;
+
+            if (child == R3_FLAT_NONE) {
+                continue;
+            }
+            dfa->parent[2 * child]     = i;
+            dfa->parent[2 * child + 1] = j;
+
+            depth[child] = depth[i] + 1;
+            if (depth[child] > dfa->depth) {
+                dfa->depth = depth[child];
+            }
+        }
+    }
+    free(depth);
+}
+
+R3Dfa * r3_dfa_create(const R3Flat * flat) {
+    R3DfaBuilder b;
+    R3Dfa * dfa;
+    unsigned char rep[256];
+    uint8_t classes[256];
+    uint32_t classes_len, s, i, k;
+
+    for (i = 0; i < flat->nodes_len; i++) {
+        if (flat->nodes[i].regex_len) {
+            return NULL;
+        }
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.flat  = flat;
+    b.spans = flat->nodes_len + flat->bytes_len;
+    b.root  = b.spans;
+
+    b.span_pos = r3_mem_alloc(sizeof(uint32_t) * (flat->edges_len + 1));
+    for (i = 0; i < flat->edges_len; i++) {
+        b.span_pos[i] = b.root;
+        if (flat->edges[i].has_slug) {
+            b.root += r3_dfa_span_len(flat->edges + i);
+        }
+    }
+
+    b.span_edge = r3_mem_alloc(sizeof(uint32_t) * (b.root - b.spans + 1));
+    for (i = 0; i < flat->edges_len; i++) {
+        for (k = b.span_pos[i]; flat->edges[i].has_slug && k < b.span_pos[i] + r3_dfa_span_len(flat->edges + i); k++) {
+            b.span_edge[k - b.spans] = i;
+        }
+    }
+
+    b.byte_edge = r3_mem_alloc(sizeof(uint32_t) * (flat->bytes_len + 1));
+    for (i = 0; i < flat->edges_len; i++) {
+        for (k = 0; k < flat->edges[i].pattern_len; k++) {
+            b.byte_edge[flat->edges[i].pattern + k] = i;
+        }
+    }
+
+    b.seen = r3_mem_alloc(sizeof(uint32_t) * (b.root + 1));
+    memset(b.seen, 0, sizeof(uint32_t) * (b.root + 1));
+
+    classes_len = r3_dfa_classes(flat, classes, rep);
+
+    // the dead state has no positions
+    r3_dfa_push(b.offsets, 0);
+    r3_dfa_push(b.offsets, 0);
+    r3_dfa_push(b.accept, R3_FLAT_NONE);
+    r3_dfa_rehash(&b);
+
+    b.gen++;
+    r3_dfa_add(&b, b.root);
+    r3_dfa_intern(&b);
+
+    r3_vector_reserve(&b.trans, classes_len);
+    memset(b.trans.entries, 0, sizeof(uint32_t) * classes_len);
+    b.trans.size = classes_len;
+
+    // states are numbered in the order they are found, each one is
+    // expanded once for a byte of every class
+    for (s = R3_DFA_START; s + 1 < b.offsets.size; s++) {
+        for (k = 0; k < classes_len; k++) {
+            uint32_t t;
+
+            b.gen++;
+            b.next.size = 0;
+
+            for (i = b.offsets.entries[s]; i < b.offsets.entries[s + 1]; i++) {
+                r3_dfa_step(&b, b.pool.entries[i], rep[k]);
+            }
+
+            if ((t = r3_dfa_intern(&b)) == R3_FLAT_NONE) {
+                r3_dfa_builder_free(&b);
+                return NULL;
+            }
+            r3_dfa_push(b.trans, t);
+        }
+    }
+
+    dfa = r3_mem_alloc(sizeof(R3Dfa));
+    memset(dfa, 0, sizeof(*dfa));
+
+    dfa->trans       = b.trans.entries;
+    dfa->accept      = b.accept.entries;
+    dfa->states_len  = b.offsets.size - 1;
+    dfa->classes_len = classes_len;
+    memcpy(dfa->classes, classes, sizeof(classes));
+
+    b.trans.entries  = NULL;
+    b.accept.entries = NULL;
+    r3_dfa_builder_free(&b);
+
+    r3_dfa_link(flat, dfa);
+    return dfa;
+}
+
+void r3_dfa_free(R3Dfa * dfa) {
+    if (!dfa) {
+        return;
+    }
+    free(dfa->trans);
+    free(dfa->accept);
+    free(dfa->parent);
+    free(dfa);
+}
+
+/**
+ * Walk the edges from the root to the endpoint again and take the slugs.
+ * Each edge consumes a fixed part of the path, as spans are possessive.
+ */
+static void r3_dfa_slugs(const R3Flat * flat, uint32_t idx, const char * path,
+    unsigned int path_len, match_entry * entry) {
+    const R3Dfa * dfa = flat->dfa;
+    const char * end = path + path_len;
+    uint32_t * chain;
+    unsigned int len = 0;
+
+    if (!dfa->depth) {
+        return;
+    }
+
+    chain = match_entry_scratch(entry, sizeof(uint32_t) * dfa->depth);
+
+    for (; dfa->parent[2 * idx] != R3_FLAT_NONE; idx = dfa->parent[2 * idx]) {
+        chain[len++] = dfa->parent[2 * idx + 1];
+    }
+
+    while (len--) {
+        const R3FlatEdge * e = flat->edges + chain[len];
+        const char * pp;
+
+        if (!e->has_slug) {
+            path += e->pattern_len;
+            continue;
+        }
+
+        pp = r3_edge_span(e->opcode, e->min, e->max, path, end);
+        str_array_append(&entry->vars, path, pp - path);
+        path = pp;
+    }
+}
+
+const R3Node * r3_dfa_matchl(const R3Flat * flat, const char * path, unsigned int path_len, match_entry * entry) {
+    const R3Dfa * dfa = flat->dfa;
+    const unsigned char * p = (const unsigned char *) path;
+    const unsigned char * end = p + path_len;
+    uint32_t s = R3_DFA_START;
+    uint32_t idx;
+
+    for (; p < end; p++) {
+        s = dfa->trans[s * dfa->classes_len + dfa->classes[*p]];
+        if (s == R3_DFA_DEAD) {
+            return NULL;
+        }
+    }
+
+    if ((idx = dfa->accept[s]) == R3_FLAT_NONE) {
+        return NULL;
+    }
+
+    // the automaton does not know the methods, the flat matcher skips the
+    // subtrees without a route for the request method
+    if (!(flat->nodes[idx].methods & r3_method_mask(entry->request_method))) {
+        return r3_flat_matchl(flat, path, path_len, entry);
+    }
+
+    r3_dfa_slugs(flat, idx, path, path_len, entry);
+    return flat->nodes[idx].node;
+}
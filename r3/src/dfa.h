@@ -0,0 +1,66 @@
+/*
+ * dfa.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_DFA_H
+#define R3_DFA_H
+
+#include <stdint.h>
+#include "r3.h"
+#include "flat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bound on the states of an automaton, larger trees keep the flat matcher
+#ifndef R3_DFA_MAX_STATES
+#define R3_DFA_MAX_STATES 4096
+#endif
+
+#define R3_DFA_DEAD  0
+#define R3_DFA_START 1
+
+/**
+ * The flat tree lowered into one deterministic automaton. Bytes which no
+ * edge tells apart share a class, the transition table holds a row of
+ * classes_len entries per state.
+ *
+ * Each state stands for the ordered set of positions in the tree the path
+ * may have reached, in the order r3_flat_matchl would try them. The accept
+ * entry of a state is the endpoint the flat matcher would return if the
+ * path ended there.
+ */
+struct _dfa {
+    uint32_t * trans;
+    uint32_t * accept;       // flat node index or R3_FLAT_NONE, per state
+    uint32_t states_len;
+    uint32_t classes_len;
+
+    // edge which leads to each flat node, to collect the slugs of a match
+    uint32_t * parent;
+    uint32_t depth;          // longest chain of edges from the root
+
+    uint8_t classes[256];
+};
+
+/**
+ * Build the automaton of a flat tree. Returns NULL if the tree has regex
+ * edges or needs more than R3_DFA_MAX_STATES states.
+ */
+R3Dfa * r3_dfa_create(const R3Flat * flat);
+
+void r3_dfa_free(R3Dfa * dfa);
+
+/**
+ * Run the path through the automaton in one pass, then fill the slugs of
+ * the endpoint into the entry.
+ */
+const R3Node * r3_dfa_matchl(const R3Flat * flat, const char * path, unsigned int path_len, match_entry * entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_DFA_H */
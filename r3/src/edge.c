@@ -64,7 +64,8 @@ R3Node * r3_edge_branch(R3Edge *e, int dl) {
     int s1_len = e->pattern.len - dl;
 
     // the suffix edge of the leaf
-    new_child = r3_tree_create(3);
+    new_child = r3_node_create(e->child->arena, 3);
+    new_child->branch = 1;
 
     new_edge = r3_node_append_edge(new_child);
     r3_edge_initl(new_edge, s1, s1_len, e->child);
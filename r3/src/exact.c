@@ -0,0 +1,134 @@
+/*
+ * exact.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "r3.h"
+#include "flat.h"
+#include "exact.h"
+
+typedef struct {
+    const R3Flat * flat;
+    match_entry entry;
+
+    R3_VECTOR(char) prefix;          // path of the node being visited
+    R3_VECTOR(char) bytes;
+    R3_VECTOR(R3ExactSlot) found;
+} R3ExactBuilder;
+
+/**
+ * Add the path of an endpoint if the tree matches it to that endpoint.
+ * A catch-all slug or an empty edge below the node could win instead.
+ */
+static void r3_exact_add(R3ExactBuilder * b, const R3Node * n) {
+    const char * path = b->prefix.entries;
+    unsigned int path_len = b->prefix.size;
+    R3ExactSlot * s;
+
+    b->entry.vars.tokens.size = 0;
+    if (r3_flat_matchl(b->flat, path, path_len, &b->entry) != n || b->entry.vars.tokens.size) {
+        return;
+    }
+
+    r3_vector_reserve(&b->found, b->found.size + 1);
+    s = b->found.entries + b->found.size++;
+    s->hash     = r3_exact_hash(path, path_len);
+    s->path     = b->bytes.size;
+    s->path_len = path_len;
+    s->methods  = r3_flat_methods(n);
+    s->node     = n;
+
+    r3_vector_reserve(&b->bytes, b->bytes.size + path_len);
+    memcpy(b->bytes.entries + b->bytes.size, path, path_len);
+    b->bytes.size += path_len;
+}
+
+/**
+ * Visit the nodes which are reached by static edges only.
+ */
+static void r3_exact_collect(R3ExactBuilder * b, const R3Node * n) {
+    unsigned int len = b->prefix.size;
+    unsigned int i;
+
+    if (n->endpoint && len) {
+        r3_exact_add(b, n);
+    }
+
+    for (i = 0; i < n->edges.size; i++) {
+        const R3Edge * e = n->edges.entries + i;
+
+        if (e->has_slug || !e->child) {
+            continue;
+        }
+
+        r3_vector_reserve(&b->prefix, len + e->pattern.len);
+        memcpy(b->prefix.entries + len, e->pattern.base, e->pattern.len);
+        b->prefix.size = len + e->pattern.len;
+
+        r3_exact_collect(b, e->child);
+        b->prefix.size = len;
+    }
+}
+
+R3Exact * r3_exact_create(const R3Node * n, const R3Flat * flat) {
+    R3ExactBuilder b;
+    R3Exact * exact = NULL;
+    uint32_t size = 16;
+    uint32_t i, j;
+
+    memset(&b, 0, sizeof(b));
+    b.flat = flat;
+    match_entry_initl(&b.entry, NULL, 0);
+
+    r3_exact_collect(&b, n);
+
+    if (b.found.size) {
+        while (size < 2 * b.found.size) {
+            size *= 2;
+        }
+
+        exact = r3_mem_alloc(sizeof(R3Exact));
+        exact->slots = r3_mem_alloc(sizeof(R3ExactSlot) * size);
+        memset(exact->slots, 0, sizeof(R3ExactSlot) * size);
+        exact->mask = size - 1;
+        exact->min_len = UINT32_MAX;
+        exact->max_len = 0;
+
+        for (i = 0; i < b.found.size; i++) {
+            const R3ExactSlot * s = b.found.entries + i;
+
+            for (j = s->hash & exact->mask; exact->slots[j].node; j = (j + 1) & exact->mask);
+            exact->slots[j] = *s;
+
+            if (s->path_len < exact->min_len) {
+                exact->min_len = s->path_len;
+            }
+            if (s->path_len > exact->max_len) {
+                exact->max_len = s->path_len;
+            }
+        }
+
+        // the table owns the pool of the paths
+        exact->bytes = b.bytes.entries;
+        b.bytes.entries = NULL;
+    }
+
+    match_entry_release(&b.entry);
+    free(b.prefix.entries);
+    free(b.bytes.entries);
+    free(b.found.entries);
+    return exact;
+}
+
+void r3_exact_free(R3Exact * exact) {
+    if (!exact) {
+        return;
+    }
+    free(exact->slots);
+    free(exact->bytes);
+    free(exact);
+}
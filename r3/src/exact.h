@@ -0,0 +1,84 @@
+/*
+ * exact.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_EXACT_H
+#define R3_EXACT_H
+
+#include <stdint.h>
+#include "r3.h"
+#include "flat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _exact_slot {
+    uint32_t hash;
+    uint32_t path;           // offset into the byte pool
+    uint32_t path_len;
+    unsigned int methods;    // request methods of the routes of the node
+    const R3Node * node;     // NULL for free slots
+} R3ExactSlot;
+
+/**
+ * Hash table of the fully static paths of a compiled tree, like /health or
+ * /api/v1/status, to their endpoints. A path is only added if the tree
+ * itself matches it to the same endpoint without captures, so a hit gives
+ * the same result as the walk through the tree.
+ */
+struct _exact {
+    R3ExactSlot * slots;
+    uint32_t mask;           // slots - 1, a power of two minus one
+    uint32_t min_len;        // bounds of the path lengths in the table
+    uint32_t max_len;
+
+    char * bytes;
+};
+
+/**
+ * Collect the static paths of the tree n, whose flat representation is
+ * flat. Returns NULL if the tree has no static endpoints.
+ */
+R3Exact * r3_exact_create(const R3Node * n, const R3Flat * flat);
+
+void r3_exact_free(R3Exact * exact);
+
+static inline uint32_t r3_exact_hash(const char * path, unsigned int path_len) {
+    uint32_t h = 2166136261u;
+
+    while (path_len--) {
+        h = (h ^ (unsigned char) *path++) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Return the endpoint of a static path, or NULL if the path is not in the
+ * table or the endpoint has no route for the methods. Then the path has to
+ * be matched by the tree.
+ */
+static inline const R3Node * r3_exact_lookup(const R3Exact * exact, const char * path, unsigned int path_len,
+    unsigned int methods) {
+    const R3ExactSlot * s;
+    uint32_t h, i;
+
+    if (path_len < exact->min_len || path_len > exact->max_len) {
+        return NULL;
+    }
+
+    h = r3_exact_hash(path, path_len);
+    for (i = h & exact->mask; (s = exact->slots + i)->node; i = (i + 1) & exact->mask) {
+        if (s->hash == h && s->path_len == path_len && !memcmp(exact->bytes + s->path, path, path_len)) {
+            return s->methods & methods ? s->node : NULL;
+        }
+    }
+    return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_EXACT_H */
@@ -0,0 +1,155 @@
+/*
+ * filter.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "r3.h"
+#include "flat.h"
+#include "exact.h"
+#include "filter.h"
+
+typedef struct {
+    const R3Flat * flat;
+    R3Filter * filter;
+
+    char prefix[R3_FILTER_PREFIX_MAX];   // path of the node being visited
+    R3_VECTOR(uint32_t) hashes;
+} R3FilterBuilder;
+
+static inline uint32_t r3_filter_add_len(uint32_t len, uint32_t n) {
+    return len > UINT32_MAX - n ? UINT32_MAX : len + n;
+}
+
+/**
+ * Bounds of the path lengths which end in an endpoint of the subtree of
+ * idx, which is reached after lo to hi bytes.
+ */
+static void r3_filter_lens(R3Filter * filter, const R3Flat * flat, uint32_t idx, uint32_t lo, uint32_t hi) {
+    const R3FlatNode * n = flat->nodes + idx;
+    uint32_t i;
+
+    if (n->methods) {
+        if (lo < filter->min_len) filter->min_len = lo;
+        if (hi > filter->max_len) filter->max_len = hi;
+    }
+
+    for (i = 0; i < n->edges_len; i++) {
+        const R3FlatEdge * e = flat->edges + n->edges + i;
+
+        if (e->child == R3_FLAT_NONE) {
+            continue;
+        }
+
+        if (i < n->static_len) {
+            r3_filter_lens(filter, flat, e->child, r3_filter_add_len(lo, e->pattern_len), r3_filter_add_len(hi, e->pattern_len));
+        } else if (e->opcode) {
+            r3_filter_lens(filter, flat, e->child, r3_filter_add_len(lo, e->min), e->max ? r3_filter_add_len(hi, e->max) : UINT32_MAX);
+        } else {
+            // a regex may match the empty string or anything
+            r3_filter_lens(filter, flat, e->child, lo, UINT32_MAX);
+        }
+    }
+}
+
+static void r3_filter_add(R3FilterBuilder * b, uint32_t len, int path) {
+    uint32_t h = r3_exact_hash(b->prefix, len);
+
+    if (path) {
+        b->filter->path_lens[len >> 5] |= 1u << (len & 31);
+        h = r3_filter_path_hash(h);
+    } else {
+        b->filter->prefix_lens[len >> 5] |= 1u << (len & 31);
+        if (len > b->filter->prefix_max) b->filter->prefix_max = len;
+        if (!len) b->filter->any = 1;
+    }
+
+    r3_vector_reserve(&b->hashes, b->hashes.size + 1);
+    b->hashes.entries[b->hashes.size++] = h;
+}
+
+/**
+ * Visit the nodes which are reached by static edges only. A node with a
+ * slug adds its path as a prefix, an endpoint as a static path.
+ */
+static void r3_filter_collect(R3FilterBuilder * b, uint32_t idx, uint32_t len) {
+    const R3FlatNode * n = b->flat->nodes + idx;
+    uint32_t i;
+
+    if (n->edges_len > n->static_len) {
+        r3_filter_add(b, len, 0);
+        return;
+    }
+    if (n->methods) {
+        r3_filter_add(b, len, 1);
+    }
+
+    for (i = 0; i < n->static_len; i++) {
+        const R3FlatEdge * e = b->flat->edges + n->edges + i;
+
+        if (e->child == R3_FLAT_NONE) {
+            continue;
+        }
+
+        if (len + e->pattern_len > R3_FILTER_PREFIX_MAX) {
+            memcpy(b->prefix + len, r3_flat_edge_pattern(b->flat, e), R3_FILTER_PREFIX_MAX - len);
+            r3_filter_add(b, R3_FILTER_PREFIX_MAX, 0);
+            continue;
+        }
+
+        memcpy(b->prefix + len, r3_flat_edge_pattern(b->flat, e), e->pattern_len);
+        r3_filter_collect(b, e->child, len + e->pattern_len);
+    }
+}
+
+R3Filter * r3_filter_create(const R3Flat * flat) {
+    R3FilterBuilder b;
+    R3Filter * filter;
+    uint32_t bits = 64, i, h;
+
+    filter = r3_mem_alloc(sizeof(R3Filter));
+    memset(filter, 0, sizeof(R3Filter));
+    filter->min_len = UINT32_MAX;
+
+    r3_filter_lens(filter, flat, 0, 0, 0);
+
+    memset(&b, 0, sizeof(b));
+    b.flat = flat;
+    b.filter = filter;
+    r3_filter_collect(&b, 0, 0);
+
+    if (filter->any && filter->min_len == 0 && filter->max_len == UINT32_MAX) {
+        free(b.hashes.entries);
+        free(filter);
+        return NULL;
+    }
+
+    while (bits < b.hashes.size * R3_FILTER_BITS) {
+        bits *= 2;
+    }
+
+    filter->bloom = r3_mem_alloc(bits / 8);
+    filter->mask = bits - 1;
+    memset(filter->bloom, 0, bits / 8);
+
+    for (i = 0; i < b.hashes.size; i++) {
+        h = b.hashes.entries[i];
+        filter->bloom[(h & filter->mask) >> 5] |= 1u << (h & 31);
+        h = r3_filter_hash2(h) & filter->mask;
+        filter->bloom[h >> 5] |= 1u << (h & 31);
+    }
+
+    free(b.hashes.entries);
+    return filter;
+}
+
+void r3_filter_free(R3Filter * filter) {
+    if (!filter) {
+        return;
+    }
+    free(filter->bloom);
+    free(filter);
+}
@@ -0,0 +1,111 @@
+/*
+ * filter.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_FILTER_H
+#define R3_FILTER_H
+
+#include <stdint.h>
+#include "r3.h"
+#include "flat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// longer prefixes and static paths are cut to prefixes of this length
+#ifndef R3_FILTER_PREFIX_MAX
+#define R3_FILTER_PREFIX_MAX 128
+#endif
+
+// bits of the bloom filter per prefix
+#define R3_FILTER_BITS 16
+
+/**
+ * Negative filter of a compiled tree. Every path which matches a route is
+ * at least min_len and at most max_len bytes long, and starts with one of
+ * the static prefixes in front of the first slug of the routes, or is one
+ * of the static paths. Both sets are kept in one bloom filter, so a path
+ * may pass the filter and still not match, but never the other way round.
+ */
+struct _filter {
+    uint32_t min_len;
+    uint32_t max_len;        // UINT32_MAX if a route has an unbounded slug
+
+    unsigned int any;        // a slug at the root, every prefix passes
+
+    // lengths of the prefixes and of the static paths
+    uint32_t prefix_lens[R3_FILTER_PREFIX_MAX / 32 + 1];
+    uint32_t path_lens[R3_FILTER_PREFIX_MAX / 32 + 1];
+    uint32_t prefix_max;     // longest prefix
+
+    uint32_t * bloom;
+    uint32_t mask;           // bits - 1, a power of two minus one
+};
+
+/**
+ * Build the filter of the flat tree. Returns NULL if it would pass every
+ * path.
+ */
+R3Filter * r3_filter_create(const R3Flat * flat);
+
+void r3_filter_free(R3Filter * filter);
+
+#define r3_filter_bit(words,i) (((words)[(i) >> 5] >> ((i) & 31)) & 1)
+
+static inline uint32_t r3_filter_hash2(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+static inline int r3_filter_has(const R3Filter * filter, uint32_t h) {
+    return r3_filter_bit(filter->bloom, h & filter->mask)
+        && r3_filter_bit(filter->bloom, r3_filter_hash2(h) & filter->mask);
+}
+
+// static paths are salted to tell them from prefixes of the same bytes
+#define r3_filter_path_hash(h) ((h) ^ 0x9e3779b9u)
+
+/**
+ * Return 1 if no route can match the path.
+ */
+static inline int r3_filter_reject(const R3Filter * filter, const char * path, unsigned int path_len) {
+    uint32_t h = 2166136261u;
+    unsigned int i, n;
+
+    if (path_len < filter->min_len || path_len > filter->max_len) {
+        return 1;
+    }
+    if (filter->any) {
+        return 0;
+    }
+
+    // one pass over the path, the hash of each prefix is at hand
+    n = path_len < filter->prefix_max ? path_len : filter->prefix_max;
+    for (i = 0; ; i++) {
+        if (r3_filter_bit(filter->prefix_lens, i) && r3_filter_has(filter, h)) {
+            return 0;
+        }
+        if (i == n) {
+            break;
+        }
+        h = (h ^ (unsigned char) path[i]) * 16777619u;
+    }
+
+    if (path_len > R3_FILTER_PREFIX_MAX || !r3_filter_bit(filter->path_lens, path_len)) {
+        return 1;
+    }
+    for (; i < path_len; i++) {
+        h = (h ^ (unsigned char) path[i]) * 16777619u;
+    }
+    return !r3_filter_has(filter, r3_filter_path_hash(h));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_FILTER_H */
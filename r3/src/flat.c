@@ -0,0 +1,559 @@
+/*
+ * flat.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "r3.h"
+#include "flat.h"
+#include "dfa.h"
+#include "exact.h"
+#include "filter.h"
+#include "scan.h"
+#include "regex.h"
+#include "r3_debug.h"
+
+static unsigned int r3_flat_static_edges(const R3Node * n) {
+    unsigned int i, cnt = 0;
+
+    for (i = 0; i < n->edges.size; i++) {
+        if (!n->edges.entries[i].has_slug && n->edges.entries[i].pattern.len) {
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+static uint32_t r3_flat_dispatch_size(unsigned int static_edges) {
+    return static_edges >= R3_FLAT_DENSE_MIN ? 256 : static_edges;
+}
+
+static void r3_flat_count(const R3Node * n, uint32_t * nodes, uint32_t * edges, uint32_t * bytes, uint32_t * dispatch) {
+    unsigned int i;
+
+    (*nodes)++;
+    *edges += n->edges.size;
+    *dispatch += r3_flat_dispatch_size(r3_flat_static_edges(n));
+
+    for (i = 0; i < n->edges.size; i++) {
+        *bytes += n->edges.entries[i].pattern.len;
+        if (n->edges.entries[i].child) {
+            r3_flat_count(n->edges.entries[i].child, nodes, edges, bytes, dispatch);
+        }
+    }
+}
+
+/**
+ * Build the first byte index of the static edges of a node, which are the
+ * first static_len edges. Static edges never share their first byte, as
+ * they would have been merged on insert.
+ */
+static void r3_flat_fill_dispatch(R3Flat * flat, const R3FlatNode * fn) {
+    uint32_t * d = flat->dispatch + fn->dispatch;
+    unsigned int i, j, len = 0;
+
+    if (fn->dispatch_dense) {
+        memset(d, 0, sizeof(uint32_t) * 256);
+    }
+
+    for (i = 0; i < fn->static_len; i++) {
+        const R3FlatEdge * e = flat->edges + fn->edges + i;
+        unsigned char c;
+
+        if (!e->pattern_len) {
+            continue;
+        }
+
+        c = (unsigned char) *r3_flat_edge_pattern(flat, e);
+
+        if (fn->dispatch_dense) {
+            if (!d[c]) d[c] = i + 1;
+            continue;
+        }
+
+        // insertion sort, sparse nodes have less than R3_FLAT_DENSE_MIN keys
+        for (j = len; j > 0 && (d[j - 1] >> 24) > c; j--) {
+            d[j] = d[j - 1];
+        }
+        d[j] = ((uint32_t) c << 24) | i;
+        len++;
+    }
+}
+
+unsigned int r3_flat_methods(const R3Node * n) {
+    unsigned int methods = 0;
+    unsigned int i;
+
+    if (!n->endpoint) {
+        return 0;
+    }
+    if (!n->routes.size) {
+        return ~0u;
+    }
+    for (i = 0; i < n->routes.size; i++) {
+        methods |= r3_method_mask(n->routes.entries[i].request_method);
+    }
+    return methods;
+}
+
+/**
+ * Append n and its subtree to the flat arrays, returns the node index.
+ *
+ * The edges of a node are reserved before descending, so they stay
+ * contiguous while the children follow their parent in depth first order.
+ */
+static uint32_t r3_flat_fill(R3Flat * flat, const R3Node * n) {
+    uint32_t idx = flat->nodes_len++;
+    R3FlatNode * fn = flat->nodes + idx;
+    unsigned int static_edges = r3_flat_static_edges(n);
+    unsigned int i, rank, pos = 0;
+
+    memset(fn, 0, sizeof(*fn));
+    fn->edges     = flat->edges_len;
+    fn->edges_len = n->edges.size;
+    fn->endpoint  = n->endpoint;
+    fn->node      = n;
+    fn->methods   = r3_flat_methods(n);
+
+    fn->subtree_methods = fn->methods;
+
+    flat->edges_len += n->edges.size;
+
+    fn->dispatch       = flat->dispatch_len;
+    fn->dispatch_len   = r3_flat_dispatch_size(static_edges);
+    fn->dispatch_dense = static_edges >= R3_FLAT_DENSE_MIN;
+
+    flat->dispatch_len += fn->dispatch_len;
+
+    for (rank = 0; rank < R3_RANK_MAX; rank++) {
+        if (rank == R3_RANK_REGEX) {
+            fn->regex = pos;
+        }
+
+        for (i = 0; i < n->edges.size; i++) {
+            const R3Edge * e = n->edges.entries + i;
+            R3FlatEdge * fe;
+
+            if (r3_edge_rank(e) != rank) {
+                continue;
+            }
+
+            fe = flat->edges + fn->edges + pos++;
+            fe->pattern     = flat->bytes_len;
+            fe->pattern_len = e->pattern.len;
+            fe->opcode      = e->opcode;
+            fe->has_slug    = e->has_slug;
+            fe->min         = e->min;
+            fe->max         = e->max;
+
+            memcpy(flat->bytes + flat->bytes_len, e->pattern.base, e->pattern.len);
+            flat->bytes_len += e->pattern.len;
+
+            fe->child = e->child ? r3_flat_fill(flat, e->child) : R3_FLAT_NONE;
+            if (fe->child != R3_FLAT_NONE) {
+                fn->subtree_methods |= flat->nodes[fe->child].subtree_methods;
+            }
+        }
+
+        if (rank == R3_RANK_STATIC) {
+            fn->static_len = pos;
+        } else if (rank == R3_RANK_REGEX) {
+            fn->regex_len = pos - fn->regex;
+        }
+    }
+
+    r3_flat_fill_dispatch(flat, fn);
+    return idx;
+}
+
+/**
+ * Freeze the compiled subtree of n into a flat representation.
+ */
+R3Flat * r3_flat_create(const R3Node * n) {
+    uint32_t nodes = 0, edges = 0, bytes = 0, dispatch = 0;
+    R3Flat * flat;
+
+    r3_flat_count(n, &nodes, &edges, &bytes, &dispatch);
+
+    flat = r3_mem_alloc(sizeof(R3Flat));
+    memset(flat, 0, sizeof(*flat));
+
+    flat->nodes = r3_mem_alloc(sizeof(R3FlatNode) * nodes);
+    flat->edges = r3_mem_alloc(sizeof(R3FlatEdge) * (edges + 1));
+    flat->bytes = r3_mem_alloc(bytes + 1);
+    flat->dispatch = r3_mem_alloc(sizeof(uint32_t) * (dispatch + 1));
+
+    r3_flat_fill(flat, n);
+
+    assert(flat->nodes_len == nodes);
+    assert(flat->edges_len == edges);
+    assert(flat->bytes_len == bytes);
+    assert(flat->dispatch_len == dispatch);
+
+    return flat;
+}
+
+void r3_flat_free(R3Flat * flat) {
+    if (!flat) {
+        return;
+    }
+    free(flat->nodes);
+    free(flat->edges);
+    free(flat->bytes);
+    free(flat->dispatch);
+    r3_dfa_free(flat->dfa);
+    r3_exact_free(flat->exact);
+    r3_filter_free(flat->filter);
+    free(flat);
+}
+
+/**
+ * Return the source node of an endpoint which has a route for one of the
+ * request methods.
+ */
+static inline const R3Node * r3_flat_endpoint(const R3Flat * flat, uint32_t idx, unsigned int methods) {
+    if (idx == R3_FLAT_NONE || !(flat->nodes[idx].methods & methods)) {
+        return NULL;
+    }
+    return flat->nodes[idx].node;
+}
+
+/**
+ * Select the static edge starting with c, in constant time for dense
+ * nodes and by binary search for the others.
+ */
+static inline const R3FlatEdge * r3_flat_dispatch(const R3Flat * flat, const R3FlatNode * n, unsigned char c) {
+    const uint32_t * d = flat->dispatch + n->dispatch;
+    unsigned int lo = 0, hi = n->dispatch_len;
+
+    if (n->dispatch_dense) {
+        return d[c] ? flat->edges + n->edges + d[c] - 1 : NULL;
+    }
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) >> 1;
+        unsigned int key = d[mid] >> 24;
+
+        if (key == c) {
+            return flat->edges + n->edges + (d[mid] & 0xFFFFFF);
+        }
+        if (key < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+static inline const R3FlatEdge * r3_flat_find_edge_str(const R3Flat * flat, const R3FlatNode * n, const char * str, unsigned int str_len) {
+    const R3FlatEdge * e = r3_flat_dispatch(flat, n, (unsigned char) *str);
+
+    if (e && e->pattern_len <= str_len && r3_scan_equal(r3_flat_edge_pattern(flat, e), str, e->pattern_len)) {
+        return e;
+    }
+    return NULL;
+}
+
+/**
+ * State of one r3_flat_matchl call.
+ */
+typedef struct {
+    const R3Flat * flat;
+    match_entry * entry;
+    r3_match_frame * top;    // level of the node being matched
+    unsigned int backtracks; // subtrees which failed to match so far
+    unsigned int steps;      // edges tried so far
+    unsigned int methods;    // mask of the request method
+} R3FlatMatch;
+
+static inline void r3_flat_frame(R3FlatMatch * m, r3_match_frame * f, uint32_t child, const char * path,
+    unsigned int path_len, int is_end) {
+    const R3FlatNode * n = m->flat->nodes + child;
+
+    f->path     = path;
+    f->path_len = path_len;
+    f->node     = child;
+    f->edge     = n->static_len && path_len ? 0 : n->static_len;
+    f->vars     = m->entry->vars.tokens.size;
+    f->is_end   = is_end;
+    f->fallback = 0;
+}
+
+/**
+ * Continue in the child of an edge with the rest of the path. The child is
+ * matched by the next iteration of r3_flat_matchl. Subtrees without a route
+ * for the request method are skipped, a subtree which would exceed
+ * R3_MATCH_DEPTH fails at once.
+ */
+static inline const R3Node * r3_flat_descend(R3FlatMatch * m, uint32_t child, const char * path,
+    unsigned int path_len, int is_end) {
+    // no route below the child takes the request method
+    if (!(m->flat->nodes[child].subtree_methods & m->methods)) {
+        return NULL;
+    }
+    if (m->top == m->entry->stack + R3_MATCH_DEPTH - 1) {
+        m->backtracks++;
+        return NULL;
+    }
+
+    r3_flat_frame(m, ++m->top, child, path, path_len, is_end);
+    return NULL;
+}
+
+static const R3Node * r3_flat_match_static(R3FlatMatch * m, const R3FlatNode * n, const char * path,
+    unsigned int path_len, int is_end) {
+    const R3FlatEdge * e = r3_flat_find_edge_str(m->flat, n, path, path_len);
+    const r3_match_frame * f = m->top;
+    unsigned int restlen;
+
+    if (!e || e->child == R3_FLAT_NONE) {
+        return NULL;
+    }
+
+    restlen = path_len - e->pattern_len;
+
+    if (!restlen) {
+        if (is_end) {
+            return r3_flat_endpoint(m->flat, e->child, m->methods);
+        }
+
+        // the child itself is the match if none of its empty edges is
+        r3_flat_descend(m, e->child, path + e->pattern_len, restlen, 1);
+        if (m->top == f) {
+            return r3_flat_endpoint(m->flat, e->child, m->methods);
+        }
+        m->top->fallback = 1;
+        return NULL;
+    }
+    return r3_flat_descend(m, e->child, path + e->pattern_len, restlen, is_end);
+}
+
+static const R3Node * r3_flat_match_opcode(R3FlatMatch * m, const R3FlatEdge * e, const char * path,
+    unsigned int path_len, int is_end) {
+    const char * pp_end = path + path_len;
+    const char * pp = r3_edge_span(e->opcode, e->min, e->max, path, pp_end);
+    unsigned int restlen;
+
+    if (!pp) {
+        return NULL;
+    }
+
+    str_array_append(&m->entry->vars, path, pp - path);
+
+    restlen = pp_end - pp;
+    if (!restlen) {
+        return r3_flat_endpoint(m->flat, e->child, m->methods);
+    }
+    if (e->child == R3_FLAT_NONE) {
+        return NULL;
+    }
+    return r3_flat_descend(m, e->child, pp, restlen, e->opcode == OP_GREEDY_ANY ? is_end : 0);
+}
+
+#ifdef HAVE_PCRE_H
+typedef PCRE2_SIZE r3_ovector_t;
+#else
+typedef uint32_t r3_ovector_t;
+#endif
+
+/**
+ * Descend into the regex edge selected by the combined pattern. Group i
+ * belongs to the i-th regex edge, unset groups have a length of 0.
+ */
+static const R3Node * r3_flat_regex_descend(R3FlatMatch * m, const R3FlatNode * n, const char * path,
+    unsigned int path_len, const r3_ovector_t * ov, unsigned int rc, int is_end) {
+    const R3FlatEdge * e;
+    unsigned int i;
+    unsigned int restlen = path_len - ov[1]; // if it's fully matched to the end (rest string length)
+
+    // Check the substring to decide we should go deeper on which edge
+    for (i = 1; i < rc && i <= n->regex_len; i++) {
+        unsigned int substring_length = ov[2*i+1] - ov[2*i];
+
+        // if it's not matched for this edge, just skip them quickly
+        if (!is_end && !substring_length) {
+            continue;
+        }
+
+        e = m->flat->edges + n->edges + n->regex + i - 1;
+
+        // append captured token to entry
+        str_array_append(&m->entry->vars, path + ov[2*i], substring_length);
+
+        // since restlen == 0 return the edge quickly.
+        if (!restlen) {
+            return r3_flat_endpoint(m->flat, e->child, m->methods);
+        }
+        if (e->child == R3_FLAT_NONE) {
+            return NULL;
+        }
+
+        // get the length of orginal string: $0
+        return r3_flat_descend(m, e->child, path + (ov[1] - ov[0]), restlen, is_end);
+    }
+    // does not match
+    return NULL;
+}
+
+#ifdef HAVE_PCRE_H
+/**
+ * Run the combined pattern of a node, with the jit code if there is any.
+ * The jit code runs on the stack of the entry, if that is exhausted the
+ * interpreter takes over.
+ */
+static int r3_flat_pcre_match(const R3Node * node, const char * path, unsigned int path_len,
+    pcre2_match_data * match_data, match_entry * entry) {
+    pcre2_match_context * match_context;
+    int rc;
+
+    if (node->pcre_jit && (match_context = match_entry_pcre_context(entry))) {
+        rc = pcre2_jit_match(node->pcre_pattern, (PCRE2_SPTR)path, path_len, 0, 0, match_data, match_context);
+        if (rc != PCRE2_ERROR_JIT_STACKLIMIT) {
+            return rc;
+        }
+    }
+    return pcre2_match(node->pcre_pattern, (PCRE2_SPTR)path, path_len, 0, PCRE2_NO_JIT, match_data, NULL);
+}
+#endif
+
+/**
+ * Match the regex edges of a node at once with the combined pattern, the
+ * first alternative which matches selects the edge.
+ */
+static const R3Node * r3_flat_match_regex(R3FlatMatch * m, const R3FlatNode * n, const char * path,
+    unsigned int path_len, int is_end) {
+    const R3Node * node = n->node;
+    int rc;
+#ifdef HAVE_PCRE_H
+    pcre2_match_data * match_data;
+
+    if (!node->pcre_pattern) {
+        return NULL;
+    }
+
+    match_data = match_entry_pcre_data(m->entry, node->capture_count + 1);
+    if (!match_data) {
+        return NULL;
+    }
+
+    rc = r3_flat_pcre_match(node, path, path_len, match_data, m->entry);
+
+    // does not match all edges, return NULL;
+    if (rc < 0) {
+        return NULL;
+    }
+
+    return r3_flat_regex_descend(m, n, path, path_len, pcre2_get_ovector_pointer(match_data), rc, is_end);
+#else
+    unsigned int ov_size;
+    uint32_t * ov;
+
+    if (!node->regex_pattern) {
+        return NULL;
+    }
+
+    // the ovector is followed by the scratch memory of the engine
+    ov_size = 2 * (r3_regex_groups(node->regex_pattern) + 1) * sizeof(uint32_t);
+    ov = match_entry_scratch(m->entry, ov_size + r3_regex_scratch_size(node->regex_pattern));
+
+    rc = r3_regex_match(node->regex_pattern, path, path_len, ov, (char *)ov + ov_size);
+
+    if (rc < 0) {
+        return NULL;
+    }
+
+    return r3_flat_regex_descend(m, n, path, path_len, ov, rc, is_end);
+#endif
+}
+
+/**
+ * Try the next edge of the node on top of the stack.
+ */
+static inline const R3Node * r3_flat_match_edge(R3FlatMatch * m, r3_match_frame * f) {
+    const R3FlatNode * n = m->flat->nodes + f->node;
+    const R3FlatEdge * e;
+    const R3Node * ret;
+
+    if (f->edge < n->static_len) {
+        f->edge = n->static_len;
+        return r3_flat_match_static(m, n, f->path, f->path_len, f->is_end);
+    }
+
+    e = m->flat->edges + n->edges + f->edge;
+    if (e->opcode) {
+        // the path ends at the node, which wins over an empty catch-all
+        if (f->fallback && e->opcode == OP_GREEDY_ANY
+            && (ret = r3_flat_endpoint(m->flat, f->node, m->methods))) {
+            return ret;
+        }
+        f->edge++;
+        return r3_flat_match_opcode(m, e, f->path, f->path_len, f->is_end);
+    }
+
+    // the combined pattern covers all regex edges
+    f->edge += n->regex_len;
+    return r3_flat_match_regex(m, n, f->path, f->path_len, f->is_end);
+}
+
+/**
+ * Match the path against the flat representation of a compiled tree and
+ * return the source node of the endpoint.
+ *
+ * The edges of a node are tried in priority order and the first one which
+ * matches is followed, with one level of the stack of the entry per node.
+ * When the subtree behind an edge fails, its captures are dropped and the
+ * next sibling is tried, up to R3_MAX_BACKTRACK failed subtrees and
+ * R3_MAX_STEPS edges per call.
+ */
+const R3Node * r3_flat_matchl(const R3Flat * flat, const char * path, unsigned int path_len, match_entry * entry) {
+    R3FlatMatch m;
+    r3_match_frame * f;
+    const R3Node * ret;
+
+    m.flat       = flat;
+    m.entry      = entry;
+    m.top        = entry->stack;
+    m.backtracks = 0;
+    m.steps      = 0;
+    m.methods    = r3_method_mask(entry->request_method);
+
+    if (!(flat->nodes[0].subtree_methods & m.methods)) {
+        return NULL;
+    }
+
+    r3_flat_frame(&m, m.top, 0, path, path_len, 0);
+
+    for (;;) {
+        f = m.top;
+
+        if (f->edge < flat->nodes[f->node].edges_len
+            && m.backtracks <= R3_MAX_BACKTRACK && m.steps < R3_MAX_STEPS) {
+            m.steps++;
+            if ((ret = r3_flat_match_edge(&m, f))) {
+                return ret;
+            }
+            if (m.top == f) {
+                entry->vars.tokens.size = f->vars;
+            }
+            continue;
+        }
+
+        // all edges of the node failed
+        if (f == entry->stack) {
+            return NULL;
+        }
+
+        m.top--;
+        m.backtracks++;
+        entry->vars.tokens.size = m.top->vars;
+
+        if (f->fallback && (ret = r3_flat_endpoint(flat, f->node, m.methods))) {
+            return ret;
+        }
+    }
+}
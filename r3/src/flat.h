@@ -0,0 +1,241 @@
+/*
+ * flat.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_FLAT_H
+#define R3_FLAT_H
+
+#include <stdint.h>
+#include "r3.h"
+#include "scan.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define R3_FLAT_NONE UINT32_MAX
+
+typedef struct _dfa R3Dfa;
+typedef struct _exact R3Exact;
+typedef struct _filter R3Filter;
+
+// nodes with at least this many static edges get a dense 256 entry table
+#define R3_FLAT_DENSE_MIN 16
+
+/**
+ * Bound on the sibling edges tried after a subtree failed to match, for
+ * one call of r3_flat_matchl.
+ */
+#ifndef R3_MAX_BACKTRACK
+#define R3_MAX_BACKTRACK 64
+#endif
+
+/**
+ * Bound on the edges tried by one call of r3_flat_matchl.
+ */
+#ifndef R3_MAX_STEPS
+#define R3_MAX_STEPS 1024
+#endif
+
+/**
+ * A compiled tree is frozen into three contiguous arrays: nodes, edges and
+ * the bytes of the edge patterns. Nodes are stored in depth first order and
+ * refer to their edges, and edges to their child nodes, by 32-bit indexes.
+ *
+ * The edges of a node are sorted by priority: static edges, typed slugs
+ * (opcodes for digits and letters, then regex edges), generic slugs and
+ * catch-all slugs. Edges of the same rank keep their insertion order.
+ */
+typedef struct _flat_node {
+    uint32_t edges;          // index of the first edge
+    uint32_t edges_len;
+    uint32_t static_len;     // static edges come first
+    uint32_t regex;          // offset of the first regex edge in the node
+    uint32_t regex_len;      // regex edges, one capture group each in the combined pattern
+    unsigned int endpoint;
+    const R3Node * node;     // the source node, holds the routes and the pcre pattern
+
+    // request methods of the routes of the node and of its whole subtree
+    unsigned int methods;
+    unsigned int subtree_methods;
+
+    // first byte index of the static edges, see r3_flat_dispatch
+    uint32_t dispatch;       // offset into the dispatch pool
+    uint16_t dispatch_len;   // number of sorted keys, or 256 when dense
+    uint16_t dispatch_dense;
+} R3FlatNode;
+
+typedef struct _flat_edge {
+    uint32_t pattern;        // offset into the byte pool
+    uint32_t pattern_len;
+    uint32_t child;          // index of the child node or R3_FLAT_NONE
+    unsigned int opcode;
+    unsigned int has_slug;
+    unsigned int min, max;   // bounds of the opcode span, see r3_edge_span
+} R3FlatEdge;
+
+struct _flat {
+    R3FlatNode * nodes;
+    uint32_t nodes_len;
+
+    R3FlatEdge * edges;
+    uint32_t edges_len;
+
+    char * bytes;
+    uint32_t bytes_len;
+
+    // dense tables hold the edge offset + 1 for each byte, sparse ones the
+    // first byte in the high 8 bits and the edge offset in the low 24 bits
+    uint32_t * dispatch;
+    uint32_t dispatch_len;
+
+    // automaton of the whole tree, see r3_dfa_create
+    R3Dfa * dfa;
+
+    // endpoints of the static paths, see r3_exact_create
+    R3Exact * exact;
+
+    // paths which can not match, see r3_filter_create
+    R3Filter * filter;
+
+    // flags of r3_tree_compile_ex
+    int flags;
+};
+
+#define r3_flat_edge_pattern(flat,e) ((flat)->bytes + (e)->pattern)
+
+/**
+ * Return the end of the longest run in [p, end) accepted by an opcode.
+ * The opcode is dispatched once per edge, the scan itself runs in the
+ * table or vector kernels.
+ */
+static inline const char * r3_opcode_span(unsigned int opcode, const char * p, const char * end) {
+    switch (opcode) {
+        case OP_EXPECT_NOSLASH:
+            return r3_scan_byte(p, end, '/');
+        case OP_EXPECT_MORE_ALPHA:
+            return r3_scan_builtin(p, end, R3_CLASS_ALPHA);
+        case OP_EXPECT_MORE_DIGITS:
+            return r3_scan_builtin(p, end, R3_CLASS_DIGIT);
+        case OP_EXPECT_MORE_WORDS:
+            return r3_scan_builtin(p, end, R3_CLASS_ALNUM);
+        case OP_EXPECT_NODASH:
+            return r3_scan_byte(p, end, '-');
+        case OP_GREEDY_ANY:
+            return r3_scan_byte(p, end, '\n');
+        case OP_EXPECT_HEX:
+            return r3_scan_builtin(p, end, R3_CLASS_HEX);
+        case OP_EXPECT_XDIGIT:
+            return r3_scan_builtin(p, end, R3_CLASS_XDIGIT);
+        case OP_EXPECT_IDENT:
+            return r3_scan_builtin(p, end, R3_CLASS_IDENT);
+        case OP_EXPECT_UUID:
+            return r3_scan_uuid(p, end, R3_CLASS_HEX);
+        case OP_EXPECT_XUUID:
+            return r3_scan_uuid(p, end, R3_CLASS_XDIGIT);
+    }
+    return p;
+}
+
+/**
+ * Return the end of the span of an opcode edge at p, which holds at most
+ * max bytes, or NULL if it is shorter than min.
+ */
+static inline const char * r3_edge_span(unsigned int opcode, unsigned int min, unsigned int max,
+    const char * p, const char * end) {
+    const char * pp;
+
+    if (max && (unsigned int)(end - p) > max) {
+        end = p + max;
+    }
+    pp = r3_opcode_span(opcode, p, end);
+    return (unsigned int)(pp - p) >= min ? pp : NULL;
+}
+
+/**
+ * Return 1 if the opcode accepts c as the i-th byte of a span, see
+ * r3_opcode_span. Only the UUID formats depend on the position.
+ */
+static inline int r3_opcode_has(unsigned int opcode, unsigned int i, unsigned char c) {
+    switch (opcode) {
+        case OP_EXPECT_NOSLASH:
+            return c != '/';
+        case OP_EXPECT_MORE_ALPHA:
+            return r3_class_has(&r3_classes[R3_CLASS_ALPHA], c);
+        case OP_EXPECT_MORE_DIGITS:
+            return r3_class_has(&r3_classes[R3_CLASS_DIGIT], c);
+        case OP_EXPECT_MORE_WORDS:
+            return r3_class_has(&r3_classes[R3_CLASS_ALNUM], c);
+        case OP_EXPECT_NODASH:
+            return c != '-';
+        case OP_GREEDY_ANY:
+            return c != '\n';
+        case OP_EXPECT_HEX:
+            return r3_class_has(&r3_classes[R3_CLASS_HEX], c);
+        case OP_EXPECT_XDIGIT:
+            return r3_class_has(&r3_classes[R3_CLASS_XDIGIT], c);
+        case OP_EXPECT_IDENT:
+            return r3_class_has(&r3_classes[R3_CLASS_IDENT], c);
+        case OP_EXPECT_UUID:
+        case OP_EXPECT_XUUID:
+            if (i == 8 || i == 13 || i == 18 || i == 23) {
+                return c == '-';
+            }
+            return r3_class_has(&r3_classes[opcode == OP_EXPECT_UUID ? R3_CLASS_HEX : R3_CLASS_XDIGIT], c);
+    }
+    return 0;
+}
+
+/**
+ * Request methods as a mask, no method stands for all of them like in
+ * r3_route_cmp.
+ */
+static inline unsigned int r3_method_mask(int method) {
+    return method ? (unsigned int) method : ~0u;
+}
+
+/**
+ * Request methods of the routes of an endpoint, a node without routes was
+ * inserted as a plain path and takes all of them.
+ */
+unsigned int r3_flat_methods(const R3Node * n);
+
+R3Flat * r3_flat_create(const R3Node * n);
+
+void r3_flat_free(R3Flat * flat);
+
+/**
+ * Priority of an edge among its siblings, lower ranks are tried first.
+ */
+enum { R3_RANK_STATIC, R3_RANK_TYPED, R3_RANK_REGEX, R3_RANK_GENERIC, R3_RANK_ANY, R3_RANK_MAX };
+
+static inline unsigned int r3_edge_rank(const R3Edge * e) {
+    if (!e->has_slug) {
+        return R3_RANK_STATIC;
+    }
+    switch (e->opcode) {
+        case 0:
+            return R3_RANK_REGEX;
+        case OP_EXPECT_MORE_DIGITS:
+        case OP_EXPECT_MORE_ALPHA:
+        case OP_EXPECT_MORE_WORDS:
+        case OP_EXPECT_HEX:
+        case OP_EXPECT_XDIGIT:
+        case OP_EXPECT_IDENT:
+        case OP_EXPECT_UUID:
+        case OP_EXPECT_XUUID:
+            return R3_RANK_TYPED;
+        case OP_GREEDY_ANY:
+            return R3_RANK_ANY;
+    }
+    return R3_RANK_GENERIC;
+}
+
+const R3Node * r3_flat_matchl(const R3Flat * flat, const char * path, unsigned int path_len, match_entry * entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_FLAT_H */
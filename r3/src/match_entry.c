@@ -7,21 +7,122 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 
 #include "r3.h"
+#include "cidr.h"
 
-match_entry * match_entry_createl(const char * path, int path_len) {
-    match_entry * entry = r3_mem_alloc( sizeof(match_entry) );
-    memset(entry, 0, sizeof(*entry));
+#ifdef HAVE_PCRE_H
+// bounds of the jit stack of an entry, the default one has 32K
+#ifndef R3_JIT_STACK_MIN
+#define R3_JIT_STACK_MIN (32 * 1024)
+#endif
+#ifndef R3_JIT_STACK_MAX
+#define R3_JIT_STACK_MAX (512 * 1024)
+#endif
+#endif
+
+void match_entry_initl(match_entry * entry, const char * path, int path_len) {
+    memset(entry, 0, offsetof(match_entry, stack));
     r3_vector_reserve(&entry->vars.tokens, 3);
     entry->path.base = path;
     entry->path.len = path_len;
+}
+
+void match_entry_release(match_entry * entry) {
+    assert(entry);
+    free(entry->vars.tokens.entries);
+    entry->vars.tokens.entries = NULL;
+    entry->vars.tokens.size = entry->vars.tokens.capacity = 0;
+#ifdef HAVE_PCRE_H
+    if (entry->match_data) {
+        pcre2_match_data_free(entry->match_data);
+        entry->match_data = NULL;
+    }
+    if (entry->match_context) {
+        pcre2_match_context_free(entry->match_context);
+        entry->match_context = NULL;
+    }
+    if (entry->jit_stack) {
+        pcre2_jit_stack_free(entry->jit_stack);
+        entry->jit_stack = NULL;
+    }
+#endif
+    free(entry->scratch);
+    entry->scratch = NULL;
+    entry->scratch_size = 0;
+}
+
+#ifdef HAVE_PCRE_H
+/**
+ * Return the scratch match data of the entry, grown to hold at least the
+ * given number of ovector pairs.
+ */
+pcre2_match_data * match_entry_pcre_data(match_entry * entry, uint32_t pairs) {
+    if (entry->match_data && pcre2_get_ovector_count(entry->match_data) >= pairs) {
+        return entry->match_data;
+    }
+    if (entry->match_data) {
+        pcre2_match_data_free(entry->match_data);
+    }
+    entry->match_data = pcre2_match_data_create(pairs, NULL);
+    return entry->match_data;
+}
+
+/**
+ * Return the match context of the entry for pcre2_jit_match, which owns
+ * the jit stack of the entry. Returns NULL if they can not be allocated.
+ */
+pcre2_match_context * match_entry_pcre_context(match_entry * entry) {
+    if (entry->match_context) {
+        return entry->match_context;
+    }
+
+    entry->jit_stack = pcre2_jit_stack_create(R3_JIT_STACK_MIN, R3_JIT_STACK_MAX, NULL);
+    if (!entry->jit_stack) {
+        return NULL;
+    }
+
+    entry->match_context = pcre2_match_context_create(NULL);
+    if (!entry->match_context) {
+        pcre2_jit_stack_free(entry->jit_stack);
+        entry->jit_stack = NULL;
+        return NULL;
+    }
+
+    pcre2_jit_stack_assign(entry->match_context, NULL, entry->jit_stack);
+    return entry->match_context;
+}
+#endif
+
+/**
+ * Return the scratch memory of the entry, grown to at least size bytes.
+ */
+void * match_entry_scratch(match_entry * entry, unsigned int size) {
+    if (entry->scratch_size < size) {
+        free(entry->scratch);
+        entry->scratch = r3_mem_alloc(size);
+        entry->scratch_size = size;
+    }
+    return entry->scratch;
+}
+
+int match_entry_remote_addr(match_entry * entry) {
+    if (!entry->remote_addr_family) {
+        entry->remote_addr_family = r3_addr_parse(entry->remote_addr.base, entry->remote_addr.len, entry->remote_addr_ip);
+    }
+    return entry->remote_addr_family;
+}
+
+match_entry * match_entry_createl(const char * path, int path_len) {
+    match_entry * entry = r3_mem_alloc( sizeof(match_entry) );
+    match_entry_initl(entry, path, path_len);
     return entry;
 }
 
 void match_entry_free(match_entry * entry) {
     assert(entry);
-    free(entry->vars.tokens.entries);
+    match_entry_release(entry);
     free(entry);
 }
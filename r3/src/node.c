@@ -3,21 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <ctype.h>
 #include <stdint.h>
-#ifdef _WIN32
-# ifdef __GNUC__
-#  if (_WIN32_WINNT < 0x0600)
-#   undef _WIN32_WINNT
-#   define _WIN32_WINNT 0x0600
-#  endif
-# endif
-# include <winsock2.h>
-# include <ws2tcpip.h>
-#else
-# include <arpa/inet.h>
-# include <netinet/in.h>
-#endif
 
 // PCRE
 #ifdef HAVE_PCRE_H
@@ -28,6 +14,15 @@
 #include "r3_slug.h"
 #include "slug.h"
 #include "str.h"
+#include "flat.h"
+#include "dfa.h"
+#include "exact.h"
+#include "filter.h"
+#include "cidr.h"
+#include "vhost.h"
+#include "regex.h"
+#include "arena.h"
+#include "pool.h"
 #include "r3_debug.h"
 
 #ifdef __GNUC__
@@ -65,43 +60,87 @@ static int strdiff(char * d1, char * d2) {
 
 
 /**
- * Create a node object
+ * Create a tree, the root node owns the arena of the tree.
  */
 R3Node * r3_tree_create(int cap) {
-    R3Node * n = r3_mem_alloc( sizeof(R3Node) );
-    memset(n, 0, sizeof(*n));
+    R3Arena * arena = r3_arena_create();
+    R3Node * n = r3_node_create(arena, cap);
+    arena->root = n;
+    return n;
+}
 
-    r3_vector_reserve(&n->edges, n->edges.size + cap);
+R3Node * r3_node_create(R3Arena * arena, int cap) {
+    R3Node * n = r3_arena_alloc(arena, sizeof(R3Node));
+    memset(n, 0, sizeof(*n));
+    n->arena = arena;
 
-    r3_vector_reserve(&n->routes, n->routes.size + 1);
+    r3_arena_vector_reserve(arena, &n->edges, n->edges.size + cap);
 
     n->compare_type = NODE_COMPARE_PCRE;
+    n->dirty = R3_DIRTY_NODE | R3_DIRTY_TREE;
     return n;
 }
 
-void r3_tree_free(R3Node * tree) {
-    for (int j=0;j<tree->edges.size;j++) {
-        r3_edge_free(tree->edges.entries + j);
-    }
-    free(tree->edges.entries);
-    for (int k=0;k<tree->routes.size;k++) {
-        r3_route_free(tree->routes.entries + k);
+static void r3_node_free_route(R3Node * n, R3Route * route) {
+    r3_arena_vector_release(n->arena, &route->slugs);
+}
+
+/**
+ * Free what the compile left at the nodes of the subtree. The blocks of the
+ * nodes are given back to the arena, unless it is freed as a whole.
+ */
+static void r3_node_free(R3Node * n, int release) {
+    for (unsigned int j = 0; j < n->edges.size; j++) {
+        r3_node_free(n->edges.entries[j].child, release);
     }
-    free(tree->routes.entries);
 #ifdef HAVE_PCRE_H
-    if (tree->pcre_pattern) {
-        pcre2_code_free(tree->pcre_pattern);
-    }
-    if (tree->match_data) {
-        pcre2_match_data_free(tree->match_data);
+    if (n->pcre_pattern) {
+        pcre2_code_free(n->pcre_pattern);
     }
+#else
+    r3_regex_free(n->regex_pattern);
 #endif
-    free(tree->combined_pattern);
-    free(tree);
-    tree = NULL;
+    free(n->combined_pattern);
+    r3_flat_free(n->flat);
+    r3_cidr_free(n->cidr);
+    r3_vhost_free(n->vhost);
+
+    if (release) {
+        for (unsigned int k = 0; k < n->routes.size; k++) {
+            r3_node_free_route(n, n->routes.entries + k);
+        }
+        r3_arena_vector_release(n->arena, &n->routes);
+        r3_arena_vector_release(n->arena, &n->edges);
+        r3_arena_release(n->arena, n, sizeof(R3Node));
+    }
 }
 
+/**
+ * Free the subtree of the node, or the whole tree with its arena if the
+ * node is the root.
+ */
+void r3_tree_free(R3Node * tree) {
+    R3Arena * arena = tree->arena;
+
+    if (arena->root == tree) {
+        r3_node_free(tree, 0);
+        r3_pool_free(arena->strings);
+        r3_arena_free(arena);
+    } else {
+        r3_node_free(tree, 1);
+    }
+}
+
+
+
+const char * r3_tree_intern(R3Node * tree, const char * str, unsigned int len) {
+    R3Arena * arena = tree->arena;
 
+    if (!arena->strings) {
+        arena->strings = r3_pool_create();
+    }
+    return r3_pool_intern(arena->strings, str, len);
+}
 
 /**
  * Connect two node objects, and create an edge object between them.
@@ -114,7 +153,7 @@ R3Edge * r3_node_connectl(R3Node * n, const char * pat, int len, int dupl, R3Nod
         return e;
     }
     if (dupl) {
-        pat = strndup(pat, len);
+        pat = r3_arena_strndup(n->arena, pat, len);
     }
     // e = r3_edge_createl(pat, len, child);
     e = r3_node_append_edge(n);
@@ -125,9 +164,10 @@ R3Edge * r3_node_connectl(R3Node * n, const char * pat, int len, int dupl, R3Nod
 
 R3Edge * r3_node_append_edge(R3Node *n)
 {
-    r3_vector_reserve(&n->edges, n->edges.size + 1);
+    r3_arena_vector_reserve(n->arena, &n->edges, n->edges.size + 1);
     R3Edge *new_e = n->edges.entries + n->edges.size++;
     memset(new_e, 0, sizeof(*new_e));
+    n->dirty |= R3_DIRTY_NODE | R3_DIRTY_TREE;
     return new_e;
 }
 
@@ -145,7 +185,7 @@ R3Edge * r3_node_find_edge(const R3Node * n, const char * pat, unsigned int pat_
         e = edge_entries + i;
         // there is a case: "{foo}" vs "{foo:xxx}",
         // we should return the match result: full-match or partial-match
-        if (e->pattern.len == pat_len &&
+        if (e->pattern.len == pat_len && (!pat_len || *e->pattern.base == *pat) &&
             !strncmp(e->pattern.base, pat, e->pattern.len)) {
             return e;
         }
@@ -153,81 +193,182 @@ R3Edge * r3_node_find_edge(const R3Node * n, const char * pat, unsigned int pat_
     return NULL;
 }
 
-int r3_tree_compile(R3Node *n, char **errstr)
+#ifdef HAVE_PCRE_H
+/**
+ * JIT compile the combined pattern of a node. PCRE2 may be built without
+ * JIT support, the node keeps using the interpreter then.
+ */
+static void r3_tree_jit_patterns(R3Node *n)
+{
+    n->pcre_jit = n->pcre_pattern && pcre2_jit_compile(n->pcre_pattern, PCRE2_JIT_COMPLETE) == 0;
+}
+#endif
+
+/**
+ * Compile the combined pattern and the route indexes of one node.
+ */
+static int r3_tree_compile_self(R3Node *n, int flags, char **errstr)
 {
-    unsigned int i;
     int ret = 0;
     // bool use_slug = r3_node_has_slug_edges(n);
     if ( r3_node_has_slug_edges(n) ) {
         if (( ret = r3_tree_compile_patterns(n, errstr) )) {
             return ret;
         }
+#ifdef HAVE_PCRE_H
+        if (flags & R3_COMPILE_JIT) {
+            r3_tree_jit_patterns(n);
+        }
+#else
+        (void)flags; // the built-in engine has no jit
+#endif
     } else {
-        // use normal text matching...
+        // use normal text matching, a branched edge may have left a pattern
+        free(n->combined_pattern);
         n->combined_pattern = NULL;
+#ifdef HAVE_PCRE_H
+        if (n->pcre_pattern) {
+            pcre2_code_free(n->pcre_pattern);
+            n->pcre_pattern = NULL;
+        }
+        n->pcre_jit = 0;
+#else
+        r3_regex_free(n->regex_pattern);
+        n->regex_pattern = NULL;
+#endif
+    }
+
+    r3_cidr_free(n->cidr);
+    n->cidr = r3_cidr_create(n);
+    r3_vhost_free(n->vhost);
+    n->vhost = r3_vhost_create(n);
+    return 0;
+}
+
+/**
+ * Compile the nodes which changed since the last compile, or all of them
+ * with force. Subtrees without changes are skipped.
+ */
+static int r3_tree_compile_node(R3Node *n, int flags, int force, char **errstr)
+{
+    unsigned int i;
+    int ret = 0;
+
+    if (!force && !n->dirty) {
+        return 0;
+    }
+
+    if (force || (n->dirty & R3_DIRTY_NODE)) {
+        if ((ret = r3_tree_compile_self(n, flags, errstr))) {
+            return ret;
+        }
+        n->dirty &= ~R3_DIRTY_NODE;
     }
 
     for (i = 0 ; i < n->edges.size ; i++ ) {
-        if ((ret = r3_tree_compile(n->edges.entries[i].child, errstr))) {
+        if ((ret = r3_tree_compile_node(n->edges.entries[i].child, flags, force, errstr))) {
             return ret; // stop here if error occurs
         }
     }
+    n->dirty = 0;
+    return 0;
+}
+
+/**
+ * Compile the patterns of all nodes and freeze the tree into its flat
+ * representation, which is used by r3_tree_matchl from now on.
+ */
+int r3_tree_compile(R3Node *n, char **errstr)
+{
+    return r3_tree_compile_ex(n, 0, errstr);
+}
+
+/**
+ * Same as r3_tree_compile. With R3_COMPILE_DFA the flat tree is lowered
+ * into one automaton, unless it has regex slugs or grows too large, then
+ * the flat matcher is used as before. R3_COMPILE_JIT has no effect on the
+ * built-in regex engine.
+ */
+int r3_tree_compile_ex(R3Node *n, int flags, char **errstr)
+{
+    int ret, force;
+
+    // only changed nodes are compiled again, unless the jit flag changed
+    force = !n->flat || (n->flat->flags & R3_COMPILE_JIT) != (flags & R3_COMPILE_JIT);
+
+    r3_flat_free(n->flat);
+    n->flat = NULL;
+
+    if ((ret = r3_tree_compile_node(n, flags, force, errstr))) {
+        return ret;
+    }
+
+    n->flat = r3_flat_create(n);
+    n->flat->flags = flags;
+    n->flat->exact = r3_exact_create(n, n->flat);
+    n->flat->filter = r3_filter_create(n->flat);
+
+    if (flags & R3_COMPILE_DFA) {
+        n->flat->dfa = r3_dfa_create(n->flat);
+    }
     return 0;
 }
 
 
 /**
- * This function combines ['/foo', '/bar', '/{slug}'] into (/foo)|(/bar)|/([^/]+)}
+ * This function combines the regex edges of a node, for example
+ * ['{id:\d{4}}', '{name}-'] into ^(\d{4})|^([^/]+)-
+ *
+ * Static and opcode edges are matched without the combined pattern, the
+ * node only needs one when it has regex edges. Without PCRE the pattern is
+ * compiled by the built-in engine, see regex.h.
  *
  * Return -1 if error occurs
  * Return 0 if success
  */
 int r3_tree_compile_patterns(R3Node * n, char **errstr) {
     R3Edge *e;
-    char * p;
-    char * cpat = calloc(1, sizeof(char) * 64 * 3); // XXX
-    if (!cpat) {
-        int r = asprintf(errstr, "Can not allocate memory");
-        if (r) {};
-        return -1;
-    }
+    R3_VECTOR(char) cpat = { NULL, 0, 0 };
 
-    p = cpat;
-    int opcode_cnt = 0;
+    int regex_cnt = 0;
     unsigned int i = 0;
     for (; i < n->edges.size ; i++) {
         e = n->edges.entries + i;
-        if (e->opcode) {
-            opcode_cnt++;
+        if (r3_edge_rank(e) != R3_RANK_REGEX) {
+            continue;
         }
 
-        if (e->has_slug) {
-            // compile "foo/{slug}" to "foo/[^/]+"
-            char * slug_pat = r3_slug_compile(e->pattern.base, e->pattern.len);
-            info("slug_pat for pattern: %s\n",slug_pat);
-            strcat(p, slug_pat);
-            free(slug_pat);
-            info("temp pattern: %s\n",cpat);
-        } else {
-            strncat(p,"^(", 2);
-            p += 2;
-
-            strncat(p, e->pattern.base, e->pattern.len);
-            p += e->pattern.len;
-
-            strncat(p++,")", 1);
+        // compile "foo/{slug}" to "^foo/([^/]+)"
+        char * slug_pat = r3_slug_compile(e->pattern.base, e->pattern.len);
+        if (!slug_pat) {
+            free(cpat.entries);
+            int r = asprintf(errstr, "Can not allocate memory");
+            if (r) {};
+            return -1;
         }
+        info("slug_pat for pattern: %s\n",slug_pat);
 
-        if ( i + 1 < n->edges.size && n->edges.size > 1 ) {
-            strncat(p++,"|",1);
+        // the buffer doubles, so a node with many edges is joined in linear time
+        unsigned int slug_len = strlen(slug_pat);
+        r3_vector_reserve(&cpat, cpat.size + slug_len + 2);
+        if (regex_cnt++) {
+            cpat.entries[cpat.size++] = '|';
         }
+        memcpy(cpat.entries + cpat.size, slug_pat, slug_len);
+        cpat.size += slug_len;
+        cpat.entries[cpat.size] = '\0';
+        free(slug_pat);
+    }
+
+    if (!cpat.entries) {
+        r3_vector_reserve(&cpat, 1);
+        cpat.entries[0] = '\0';
     }
 
-    info("pattern: %s\n",cpat);
+    info("pattern: %s\n",cpat.entries);
 
     // if all edges use opcode, we should skip the combined_pattern.
-    if ( opcode_cnt == n->edges.size ) {
-        // free(cpat);
+    if ( !regex_cnt ) {
         n->compare_type = NODE_COMPARE_OPCODE;
     } else {
         n->compare_type = NODE_COMPARE_PCRE;
@@ -235,7 +376,7 @@ int r3_tree_compile_patterns(R3Node * n, char **errstr) {
     info("COMPARE_TYPE: %d\n",n->compare_type);
 
     free(n->combined_pattern);
-    n->combined_pattern = cpat;
+    n->combined_pattern = cpat.entries;
 #ifdef HAVE_PCRE_H
 
     int pcre_errorcode = 0;
@@ -244,6 +385,11 @@ int r3_tree_compile_patterns(R3Node * n, char **errstr) {
 
     if (n->pcre_pattern) {
         pcre2_code_free(n->pcre_pattern);
+        n->pcre_pattern = NULL;
+    }
+    n->pcre_jit = 0;
+    if ( !regex_cnt ) {
+        return 0;
     }
     n->pcre_pattern = pcre2_compile(
             (PCRE2_SPTR)n->combined_pattern,  /* the pattern, 8-bit code units */
@@ -263,17 +409,17 @@ int r3_tree_compile_patterns(R3Node * n, char **errstr) {
         }
         return -1;
     }
-    if (n->match_data) {
-        pcre2_match_data_free(n->match_data);
+    uint32_t capture_count = 0;
+    pcre2_pattern_info(n->pcre_pattern, PCRE2_INFO_CAPTURECOUNT, &capture_count);
+    n->capture_count = capture_count;
+#else
+    r3_regex_free(n->regex_pattern);
+    n->regex_pattern = NULL;
+    if ( !regex_cnt ) {
+        return 0;
     }
-    n->match_data = pcre2_match_data_create_from_pattern(n->pcre_pattern, NULL);
-    if (n->match_data == NULL) {
-        if (errstr) {
-            int r = asprintf(errstr, "Failed to allocate match data block");
-            if (r < 0) {
-                *errstr = NULL; /* the content of errstr is undefined when asprintf() fails */
-            }
-        }
+    n->regex_pattern = r3_regex_compile(n->combined_pattern, cpat.size, errstr);
+    if (n->regex_pattern == NULL) {
         return -1;
     }
 #endif
@@ -304,45 +450,25 @@ static R3Node * r3_tree_matchl_base(const R3Node * n, const char * path,
         e = n->edges.entries;
         unsigned int cies = n->edges.size;
         for (i = 0; i < cies; i++) {
-            pp = path;
-            switch(e->opcode) {
-                case OP_EXPECT_NOSLASH:
-                    while (*pp != '/' && pp < pp_end) pp++;
-                    break;
-                case OP_EXPECT_MORE_ALPHA:
-                    while ( isalpha(*pp) && pp < pp_end) pp++;
-                    break;
-                case OP_EXPECT_MORE_DIGITS:
-                    while ( isdigit(*pp) && pp < pp_end) pp++;
-                    break;
-                case OP_EXPECT_MORE_WORDS:
-                    while ( (isdigit(*pp) || isalpha(*pp)) && pp < pp_end) pp++;
-                    break;
-                case OP_EXPECT_NODASH:
-                    while (*pp != '-' && pp < pp_end) pp++;
-                    break;
-                case OP_GREEDY_ANY:
-                    while (*pp != '\n' && pp < pp_end) pp++;
-                    break;
-            }
+            pp = r3_edge_span(e->opcode, e->min, e->max, path, pp_end);
 
             // check match
+            if (!pp) {
+                e++;
+                continue;
+            }
             if (e->opcode != OP_GREEDY_ANY) {
                 if ((pp - path) > 0) {
-                    if (entry) {
-                        str_array_append(&entry->vars , path, pp - path);
-                    }
+                    str_array_append(&entry->vars , path, pp - path);
                     restlen = pp_end - pp;
                     if (!restlen) {
                         return e->child && e->child->endpoint ? e->child : NULL;
                     }
-                    return r3_tree_matchl(e->child, pp, restlen, entry);
+                    return r3_tree_matchl_base(e->child, pp, restlen, entry, 0);
                 }
 
             } else {
-                if (entry) {
-                    str_array_append(&entry->vars , path, pp - path);
-                }
+                str_array_append(&entry->vars , path, pp - path);
                 restlen = pp_end - pp;
                 if (!restlen) {
                     return e->child && e->child->endpoint ? e->child : NULL;
@@ -362,6 +488,11 @@ static R3Node * r3_tree_matchl_base(const R3Node * n, const char * path,
         const char *substring_start = 0;
         int   substring_length = 0;
         int   rc;
+        pcre2_match_data *match_data = match_entry_pcre_data(entry, n->capture_count + 1);
+
+        if (!match_data) {
+            return NULL;
+        }
 
         info("pcre matching %s on [%s]\n", n->combined_pattern, path);
 
@@ -371,7 +502,7 @@ static R3Node * r3_tree_matchl_base(const R3Node * n, const char * path,
                 path_len,     /* the length of the subject */
                 0,            /* start at offset 0 in the subject */
                 0,            /* default options */
-                n->match_data,/* match data results */
+                match_data,   /* match data results */
                 NULL);        /* match context */
 
         // does not match all edges, return NULL;
@@ -393,7 +524,7 @@ static R3Node * r3_tree_matchl_base(const R3Node * n, const char * path,
             return NULL;
         }
 
-        PCRE2_SIZE *ov = pcre2_get_ovector_pointer(n->match_data);
+        PCRE2_SIZE *ov = pcre2_get_ovector_pointer(match_data);
 
         restlen = path_len - ov[1]; // if it's fully matched to the end (rest string length)
 
@@ -411,7 +542,7 @@ static R3Node * r3_tree_matchl_base(const R3Node * n, const char * path,
                 substring_start = path + ov[2*i];
                 e = n->edges.entries + i - 1;
 
-                if (entry && e->has_slug) {
+                if (e->has_slug) {
                     // append captured token to entry
                     str_array_append(&entry->vars, substring_start, substring_length);
                 }
@@ -435,7 +566,7 @@ static R3Node * r3_tree_matchl_base(const R3Node * n, const char * path,
             substring_start = path + ov[2*i];
             e = n->edges.entries + i - 1;
 
-            if (entry && e->has_slug) {
+            if (e->has_slug) {
                 // append captured token to entry
                 str_array_append(&entry->vars , substring_start, substring_length);
             }
@@ -469,6 +600,33 @@ static R3Node * r3_tree_matchl_base(const R3Node * n, const char * path,
     return NULL;
 }
 
+/**
+ * Look up a path which is reached by static edges only, like the exact
+ * table of the flat tree does, but in the nodes. Such a path is the first
+ * candidate of the match, so it also wins over routes of the flat tree.
+ */
+static const R3Node * r3_tree_matchl_static(const R3Node * n, const char * path,
+    unsigned int path_len, unsigned int methods) {
+    const R3Edge *e;
+    unsigned int i;
+
+    while (path_len) {
+        for (i = 0; i < n->edges.size; i++) {
+            e = n->edges.entries + i;
+            if (!e->has_slug && e->child && e->pattern.len && e->pattern.len <= path_len
+                && !memcmp(e->pattern.base, path, e->pattern.len)) {
+                break;
+            }
+        }
+        if (i == n->edges.size) {
+            return NULL;
+        }
+        path += e->pattern.len;
+        path_len -= e->pattern.len;
+        n = e->child;
+    }
+    return r3_flat_methods(n) & methods ? n : NULL;
+}
 
 /**
  * This function matches the URL path and return the left node
@@ -479,32 +637,100 @@ static R3Node * r3_tree_matchl_base(const R3Node * n, const char * path,
  * @param char*        path     the URL path to dispatch
  * @param int          path_len the length of the URL path.
  * @param match_entry* entry match_entry is used for saving the captured dynamic strings from pcre result.
+ *                           It also carries the scratch space of the call, so several threads may match
+ *                           against the same compiled tree as long as each one uses its own entry.
  */
 R3Node * r3_tree_matchl(const R3Node * n, const char * path,
     unsigned int path_len, match_entry * entry) {
-    return r3_tree_matchl_base(n, path, path_len, entry, 0);
+    R3Node *ret;
+    match_entry scratch;
+
+    if (!entry) {
+        match_entry_initl(&scratch, path, path_len);
+        ret = r3_tree_matchl(n, path, path_len, &scratch);
+        match_entry_release(&scratch);
+        return ret;
+    }
+
+    // the tree has not been compiled yet, walk the nodes
+    if (!n->flat) {
+        return r3_tree_matchl_base(n, path, path_len, entry, 0);
+    }
+
+    // routes inserted since the last compile are not in the flat tree yet,
+    // the static ones are found in the nodes, the others after a compile
+    if (n->dirty && (ret = (R3Node *) r3_tree_matchl_static(n, path, path_len,
+            r3_method_mask(entry->request_method)))) {
+        return ret;
+    }
+
+    // fully static paths are looked up at once
+    if (n->flat->exact && (ret = (R3Node *) r3_exact_lookup(n->flat->exact, path, path_len,
+            r3_method_mask(entry->request_method)))) {
+        return ret;
+    }
+
+    // paths which can not match any route are turned away without a walk
+    if (n->flat->filter && r3_filter_reject(n->flat->filter, path, path_len)) {
+        entry->rejected = 1;
+        return NULL;
+    }
+
+    if (n->flat->dfa) {
+        return (R3Node *) r3_dfa_matchl(n->flat, path, path_len, entry);
+    }
+
+    return (R3Node *) r3_flat_matchl(n->flat, path, path_len, entry);
 }
 
 
 
 R3Route * r3_tree_match_route(const R3Node *tree, match_entry * entry) {
-    R3Node *n;
-    R3Route *r;
-    n = r3_tree_match_entry(tree, entry);
+    return r3_node_match_route(r3_tree_match_entry(tree, entry), entry);
+}
+
+R3Route * r3_node_match_route(const R3Node *n, match_entry * entry) {
+    R3Route *r = NULL;
     unsigned int i, irs;
-    if (n && (irs = n->routes.size)) {
-        r = n->routes.entries;
+    if (!n || !(irs = n->routes.size)) {
+        return NULL;
+    }
+
+    // the indexes are left out if routes were added since the compile
+    if (n->vhost && n->vhost->routes_len == irs && entry->host.len) {
+        r = r3_vhost_match_route(n->vhost, n, entry);
+    } else if (n->cidr && n->cidr->routes_len == irs) {
+        r = r3_cidr_match_route(n->cidr, n, entry);
+    } else {
         for (i = 0; irs - i; i++) {
-            if ( r3_route_cmp(r, entry) == 0 ) {
-                // Add slugs from found route to match_entry
-                entry->vars.slugs.entries = r->slugs.entries;
-                entry->vars.slugs.size = r->slugs.size;
-                return r;
+            if (r3_route_has_addr(n->routes.entries + i)) {
+                match_entry_remote_addr(entry);
+            }
+            if ( r3_route_cmp(n->routes.entries + i, entry) == 0 ) {
+                r = n->routes.entries + i;
+                break;
             }
-            r++;
         }
     }
-    return NULL;
+
+    if (r) {
+        // Add slugs from found route to match_entry
+        entry->vars.slugs.entries = r->slugs.entries;
+        entry->vars.slugs.size = r->slugs.size;
+    }
+    return r;
+}
+
+void r3_tree_each_route(const R3Node *n, void (*fn)(R3Route *route, void *udata), void *udata) {
+    unsigned int i;
+    for (i = 0; i < n->routes.size; i++) {
+        fn(n->routes.entries + i, udata);
+    }
+    for (i = 0; i < n->edges.size; i++) {
+        if (n->edges.entries[i].child) {
+            r3_tree_each_route(n->edges.entries[i].child, fn, udata);
+        }
+    }
 }
 
 inline R3Edge * r3_node_find_edge_str(const R3Node * n, const char * str, int str_len) {
@@ -542,11 +768,6 @@ inline R3Edge * r3_node_find_edge_str(const R3Node * n, const char * str, int st
 //     return n;
 // }
 
-void r3_route_free(R3Route * route) {
-    assert(route);
-    free(route->slugs.entries);
-}
-
 // static bool router_slugs_full(const R3Route * route) {
 //     return route->slugs_len >= route->slugs_cap;
 // }
@@ -557,16 +778,16 @@ void r3_route_free(R3Route * route) {
 //     return route->slugs != NULL;
 // }
 
-static r3_iovec_t* router_append_slug(R3Route * route, const char * slug, unsigned int len) {
+static r3_iovec_t* router_append_slug(R3Arena * arena, R3Route * route, const char * slug, unsigned int len) {
     r3_iovec_t *temp;
-    r3_vector_reserve(&route->slugs, route->slugs.size + 1);
+    r3_arena_vector_reserve(arena, &route->slugs, route->slugs.size + 1);
     temp = route->slugs.entries + route->slugs.size++;
     temp->base = slug;
     temp->len = len;
     return temp;
 }
 
-static void get_slugs(R3Route * route, const char * path, int path_len) {
+static void get_slugs(R3Arena * arena, R3Route * route, const char * path, int path_len) {
     const char *plh = path;
     const char *name;
     unsigned int plhl, namel;
@@ -575,18 +796,19 @@ static void get_slugs(R3Route * route, const char * path, int path_len) {
         if (!plh) break;
         name = r3_slug_find_name(plh, plhl, &namel);
         if (name) {
-            router_append_slug(route, name, namel);
+            router_append_slug(arena, route, name, namel);
         }
         plh += plhl;
     }
 }
 
 R3Route * r3_node_append_route(R3Node *tree, const char * path, int path_len, int method, void *data) {
-    r3_vector_reserve(&tree->routes, tree->routes.size + 1);
+    r3_arena_vector_reserve(tree->arena, &tree->routes, tree->routes.size + 1);
     R3Route *info = tree->routes.entries + tree->routes.size++;
     memset(info, 0, sizeof(*info));
+    tree->dirty |= R3_DIRTY_NODE;
 
-    r3_vector_reserve(&info->slugs, info->slugs.size + 3);
+    r3_arena_vector_reserve(tree->arena, &info->slugs, info->slugs.size + 3);
     info->path.base = (char*) path;
     info->path.len = path_len;
     info->request_method = method; // ALLOW GET OR POST METHOD
@@ -605,17 +827,161 @@ R3Route * r3_node_append_route(R3Node *tree, const char * path, int path_len, in
  * method (int): METHOD_GET, METHOD_POST, METHOD_PUT, METHOD_DELETE ...
  */
 R3Route * r3_tree_insert_routel_ex(R3Node *tree, int method, const char *path, int path_len, void *data, char **errstr) {
+    // the edges and the route point into the copy, not into the caller's string
+    path = r3_tree_intern(tree, path, path_len);
+
     R3Node * ret = r3_tree_insert_pathl_ex(tree, path, path_len, method, 1, data, errstr);
     if (ret == NULL) {
         return NULL;
     }
     R3Route *router = ret->routes.entries + (ret->routes.size - 1);
-    get_slugs(router, path, path_len);
+    router->path = r3_iovec_init(path, path_len);
+    router->serial = ++tree->arena->serial;
+    get_slugs(ret->arena, router, path, path_len);
 
     return router;
 }
 
+/**
+ * Return 1 if the edge f, the only one below e, is the rest of the edge
+ * which r3_edge_branch split into e and f, so that both can be joined.
+ */
+static int r3_edge_is_joinable(const R3Edge *e, const R3Edge *f) {
+    return e->child->branch && !e->opcode && !f->opcode
+        && e->pattern.base + e->pattern.len == f->pattern.base;
+}
+
+/**
+ * Repair the i-th edge of n after routes below it were removed. The edge is
+ * dropped if nothing is left below it, and joined with the edge below if
+ * its child was only put there by r3_edge_branch.
+ */
+static void r3_node_repair_edge(R3Node *n, unsigned int i) {
+    R3Edge *e = n->edges.entries + i, *f;
+    R3Node *child = e->child;
+
+    if (child->routes.size || child->endpoint) {
+        return;
+    }
 
+    if (!child->edges.size) {
+        r3_tree_free(child);
+        memmove(e, e + 1, sizeof(R3Edge) * (n->edges.size - i - 1));
+        n->edges.size--;
+        n->dirty |= R3_DIRTY_NODE;
+        return;
+    }
+
+    f = child->edges.entries;
+    if (child->edges.size == 1 && r3_edge_is_joinable(e, f)) {
+        e->pattern.len += f->pattern.len;
+        e->has_slug = r3_path_contains_slug_char(e->pattern.base, e->pattern.len);
+        e->child = f->child;
+        child->edges.size = 0;
+        r3_tree_free(child);
+        n->dirty |= R3_DIRTY_NODE;
+    }
+}
+
+/**
+ * Remove the routes of method and path from the node which the rest of the
+ * path leads to. Returns the number of removed routes.
+ */
+static int r3_node_delete_routes(R3Node *n, int method, const char *path, unsigned int path_len,
+    const char *rest, unsigned int rest_len) {
+    unsigned int i, j;
+    int removed = 0;
+
+    if (!rest_len) {
+        for (i = j = 0; i < n->routes.size; i++) {
+            R3Route *route = n->routes.entries + i;
+
+            if (route->request_method == method && route->path.len == path_len
+                    && (!path_len || !memcmp(route->path.base, path, path_len))) {
+                r3_node_free_route(n, route);
+                removed++;
+            } else {
+                n->routes.entries[j++] = *route;
+            }
+        }
+        if (!removed) {
+            return 0;
+        }
+
+        n->routes.size = j;
+        n->endpoint = n->endpoint > (unsigned int) removed ? n->endpoint - removed : 0;
+        if (n->routes.size) {
+            n->data = n->routes.entries[n->routes.size - 1].data;
+        } else if (!n->endpoint) {
+            n->data = NULL;
+        }
+        n->dirty |= R3_DIRTY_NODE | R3_DIRTY_TREE;
+        return removed;
+    }
+
+    // all routes of the path are below the same edge
+    for (i = 0; i < n->edges.size; i++) {
+        R3Edge *e = n->edges.entries + i;
+
+        if (e->pattern.len > rest_len || memcmp(e->pattern.base, rest, e->pattern.len)) {
+            continue;
+        }
+        removed = r3_node_delete_routes(e->child, method, path, path_len,
+            rest + e->pattern.len, rest_len - e->pattern.len);
+        if (removed) {
+            n->dirty |= R3_DIRTY_TREE;
+            r3_node_repair_edge(n, i);
+            break;
+        }
+    }
+    return removed;
+}
+
+/**
+ * Remove all routes which were inserted with the method and path. Empty
+ * nodes are pruned on the way back to the root. A compiled tree is
+ * compiled again, which touches only the changed nodes.
+ *
+ * Return the number of removed routes, or -1 if the compile failed.
+ */
+int r3_tree_delete_routel_ex(R3Node *tree, int method, const char *path, int path_len, char **errstr) {
+    int removed = r3_node_delete_routes(tree, method, path, path_len, path, path_len);
+
+    if (removed && tree->flat && r3_tree_compile_ex(tree, tree->flat->flags, errstr)) {
+        return -1;
+    }
+    return removed;
+}
+
+
+
+/**
+ * Opcode of a slug like {id:\d+}, a slug without pattern is [^/]+.
+ * Returns 0 if the pattern needs the regex engine.
+ */
+static int r3_slug_opcode(const char * slug, unsigned int slug_len, unsigned int * min, unsigned int * max) {
+    unsigned int pattern_len = 0;
+    const char * pattern = r3_slug_find_pattern(slug, slug_len, &pattern_len);
+
+    if (!pattern_len) {
+        *min = 1;
+        *max = 0;
+        return OP_EXPECT_NOSLASH;
+    }
+    return r3_pattern_to_opcode_ex(pattern, pattern_len, min, max);
+}
+
+/**
+ * Return 1 if an opcode slug followed by the byte next matches the same
+ * as the regex would, which may backtrack into the slug. That holds for
+ * fixed length spans and for spans which stop at next anyway.
+ */
+static int r3_slug_is_possessive(int opcode, unsigned int min, unsigned int max, char next) {
+    if (!opcode) {
+        return 0;
+    }
+    return (max && min == max) || (next != '{' && !r3_opcode_has(opcode, 0, next));
+}
 
 /**
  * Find common prefix from the edges of the node.
@@ -648,40 +1014,36 @@ R3Edge * r3_node_find_common_prefix(R3Node *n, const char *path, int path_len, i
 
     // found common prefix edge
     if (prefix > 0) {
-        r3_slug_t *slug;
+        r3_slug_t slug;
         int ret = 0;
         const char *offset = path;
         const char *p = path + prefix;
 
-        slug = r3_slug_new(path, path_len);
+        r3_slug_init(&slug, path, path_len);
 
         do {
-            ret = r3_slug_parse(slug, path, path_len, offset, errstr);
+            ret = r3_slug_parse(&slug, path, path_len, offset, errstr);
             // found slug
             if (ret == 1) {
                 // inside slug, backtrace to the begin of the slug
-                if ( p >= slug->begin && p <= slug->end ) {
-                    prefix = slug->begin - path - 1;
+                if ( p >= slug.begin && p <= slug.end ) {
+                    prefix = slug.begin - path - 1;
                     break;
-                } else if ( p < slug->begin ) {
+                } else if ( p < slug.begin ) {
                     break;
-                } else if ( p >= slug->end && p < (path + path_len) ) {
-                    offset = slug->end + 1;
+                } else if ( p >= slug.end && p < (path + path_len) ) {
+                    offset = slug.end + 1;
                     prefix = p - path;
                     continue;
                 } else {
                     break;
                 }
             } else if (ret == -1) {
-                r3_slug_free(slug);
                 return NULL;
             } else {
                 break;
             }
         } while(ret == 1);
-
-        // free the slug
-        r3_slug_free(slug);
     }
 
     *prefix_len = prefix;
@@ -701,6 +1063,9 @@ R3Node * r3_tree_insert_pathl_ex(R3Node *tree, const char *path, unsigned int pa
     // common edge
     R3Edge * e = NULL;
 
+    // the path to the changed nodes is compiled again
+    tree->dirty |= R3_DIRTY_TREE;
+
     // If there is no path to insert at the node, we just increase the mount
     // point on the node and append the route.
     if (path_len == 0) {
@@ -738,58 +1103,53 @@ R3Node * r3_tree_insert_pathl_ex(R3Node *tree, const char *path, unsigned int pa
             return NULL;
         }
         info("slug_cnt: %d\n",slug_cnt);
-        if ( slug_cnt > 1 ) {
-            unsigned int   slug_len;
-            const char *p = r3_slug_find_placeholder(path, path_len, &slug_len);
-            assert(p);
+        // see if the first slug is optimiz-able by opcode
+        unsigned int slug_len = 0, slug_min = 1, slug_max = 0;
+        const char *slug_p = NULL;
+        int opcode = 0;
+
+        if (slug_cnt > 0) {
+            slug_p = r3_slug_find_placeholder(path, path_len, &slug_len);
+            assert(slug_p);
+            opcode = r3_slug_opcode(slug_p, slug_len, &slug_min, &slug_max);
+            info("opcode: %d\n", opcode);
+        }
+
+        // there are two more slugs, we should break them into several parts.
+        // an opcode slug gets an edge of its own if its span can not give
+        // back bytes to the text after it.
+        if ( slug_cnt > 1 && !r3_slug_is_possessive(opcode, slug_min, slug_max, slug_p[slug_len]) ) {
+            const char *p = slug_p + slug_len;
 
             // find the next one '{', then break there
-            p = r3_slug_find_placeholder(p + slug_len + 1, path_len - slug_len - 1, NULL);
+            p = r3_slug_find_placeholder(p, path_len - (int)(p - path), NULL);
             assert(p);
 
             // insert the first one edge, and break at "p"
-            R3Node * child = r3_tree_create(3);
+            R3Node * child = r3_node_create(tree->arena, 3);
             r3_node_connectl(n, path, p - path, 0, child); // no duplicate
 
             // and insert the rest part to the child
             return r3_tree_insert_pathl_ex(child, p, path_len - (int)(p - path),  method, 1, data, errstr);
 
         } else {
-            if (slug_cnt == 1) {
-                // there is one slug, let's see if it's optimiz-able by opcode
-                unsigned int   slug_len = 0;
-                const char *slug_p = r3_slug_find_placeholder(path, path_len, &slug_len);
-                assert(slug_p);
-                unsigned int   slug_pattern_len = 0;
-                const char *slug_pattern = r3_slug_find_pattern(slug_p, slug_len, &slug_pattern_len);
-
-                int opcode = 0;
-                // if there is a pattern defined.
-                if (slug_pattern_len) {
-                    char *cpattern = r3_slug_compile(slug_pattern, slug_pattern_len);
-                    info("cpattern: %s\n", cpattern);
-                    opcode = r3_pattern_to_opcode(cpattern, strlen(cpattern));
-                    info("opcode: %d\n", opcode);
-                    free(cpattern);
-                } else {
-                    opcode = OP_EXPECT_NOSLASH;
-                }
-
-
+            if (slug_cnt > 0) {
                 // if the slug starts after one+ charactor, for example foo{slug}
                 R3Node *c1;
                 if (slug_p > path) {
-                    c1 = r3_tree_create(3);
+                    c1 = r3_node_create(tree->arena, 3);
                     r3_node_connectl(n, path, slug_p - path, 0, c1); // no duplicate
                 } else {
                     c1 = n;
                 }
 
-                R3Node * c2 = r3_tree_create(3);
+                R3Node * c2 = r3_node_create(tree->arena, 3);
 
                 R3Edge * op_edge = r3_node_connectl(c1, slug_p, slug_len , 0, c2);
                 if(opcode) {
                     op_edge->opcode = opcode;
+                    op_edge->min    = slug_min;
+                    op_edge->max    = slug_max;
                 }
 
                 int restlen = path_len - ((slug_p - path) + slug_len);
@@ -808,7 +1168,7 @@ R3Node * r3_tree_insert_pathl_ex(R3Node *tree, const char *path, unsigned int pa
                 return c2;
             }
             // only one slug
-            R3Node * child = r3_tree_create(3);
+            R3Node * child = r3_node_create(tree->arena, 3);
             child->endpoint++;
             if (data)
                 child->data = data;
@@ -854,6 +1214,7 @@ R3Node * r3_tree_insert_pathl_ex(R3Node *tree, const char *path, unsigned int pa
          * we should split the end point and make a branch here...
          */
         r3_edge_branch(e, prefix_len);
+        tree->dirty |= R3_DIRTY_NODE; // the pattern of e is shorter now
         return r3_tree_insert_pathl_ex(e->child, subpath, subpath_len, method, 1, data, errstr);
     } else {
         fprintf(stderr, "unexpected route.");
@@ -966,47 +1327,21 @@ inline int r3_route_cmp(const R3Route *r1, const match_entry *r2) {
         }
     }
 
-    if (r1->remote_addr_v4_bits > 0) {
-        if (!r2->remote_addr.base) {
-            return -1;
-        }
+    if (r3_route_has_addr(r1)) {
+        const uint32_t * ip = r2->remote_addr_ip;
+        int family = r2->remote_addr_family;
+        uint32_t addr[4];
 
-        uint32_t addr;
-        if(inet_pton(AF_INET, r2->remote_addr.base, (void *)&addr) != 1) {
-            return -1;
+        // parsed only once if the entry went through match_entry_remote_addr
+        if (!family) {
+            family = r3_addr_parse(r2->remote_addr.base, r2->remote_addr.len, addr);
+            ip = addr;
         }
-
-        unsigned int r2_addr = ntohl(addr);
-        int bits = 32 - r1->remote_addr_v4_bits;
-        if (r1->remote_addr_v4 >> bits != r2_addr >> bits) {
+        if (!r3_route_addr_match(r1, family, ip)) {
             return -1;
         }
     }
 
-    info("r1 v6_bits[0]: %d\n", r1->remote_addr_v6_bits[0]);
-    if (r1->remote_addr_v6_bits[0] > 0) {
-        if (!r2->remote_addr.base) {
-            return -1;
-        }
-
-        struct in6_addr    addr6;
-        if(inet_pton(AF_INET6, r2->remote_addr.base, (void *)&addr6) != 1) {
-            return -1;
-        }
-
-        for (int i = 0; i < 4; i++) {
-            int bits = 32 - r1->remote_addr_v6_bits[i];
-            if (bits == 32) {
-                continue;
-            }
-
-            unsigned int r2_addr = ntohl(*((uint32_t *)(&addr6.s6_addr[4*i])));
-            if (r1->remote_addr_v6[i] >> bits != r2_addr >> bits) {
-                return -1;
-            }
-        }
-    }
-
     return 0;
 }
 
@@ -0,0 +1,90 @@
+/*
+ * pool.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "r3.h"
+#include "arena.h"
+#include "pool.h"
+
+// slots of a new pool, the table doubles at 3/4 load
+#define R3_POOL_SLOTS_MIN 64
+
+static uint32_t r3_pool_hash(const char * str, unsigned int len) {
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h = (h ^ (unsigned char) *str++) * 16777619u;
+    }
+    return h;
+}
+
+static R3PoolSlot * r3_pool_slot(R3PoolSlot * slots, uint32_t mask, uint32_t h, const char * str, unsigned int len) {
+    R3PoolSlot * s;
+    uint32_t i;
+
+    for (i = h & mask; (s = slots + i)->str; i = (i + 1) & mask) {
+        if (s->hash == h && s->len == len && !memcmp(s->str, str, len)) {
+            break;
+        }
+    }
+    return s;
+}
+
+static void r3_pool_rehash(R3Pool * pool, uint32_t capacity) {
+    R3PoolSlot * slots = r3_mem_alloc(sizeof(R3PoolSlot) * capacity);
+    uint32_t i;
+
+    memset(slots, 0, sizeof(R3PoolSlot) * capacity);
+    for (i = 0; pool->slots && i <= pool->mask; i++) {
+        R3PoolSlot * s = pool->slots + i;
+
+        if (s->str) {
+            *r3_pool_slot(slots, capacity - 1, s->hash, s->str, s->len) = *s;
+        }
+    }
+
+    free(pool->slots);
+    pool->slots = slots;
+    pool->mask = capacity - 1;
+}
+
+R3Pool * r3_pool_create(void) {
+    R3Pool * pool = r3_mem_alloc(sizeof(R3Pool));
+    memset(pool, 0, sizeof(*pool));
+    pool->bytes = r3_arena_create();
+    r3_pool_rehash(pool, R3_POOL_SLOTS_MIN);
+    return pool;
+}
+
+void r3_pool_free(R3Pool * pool) {
+    if (!pool) {
+        return;
+    }
+    r3_arena_free(pool->bytes);
+    free(pool->slots);
+    free(pool);
+}
+
+const char * r3_pool_intern(R3Pool * pool, const char * str, unsigned int len) {
+    uint32_t h = r3_pool_hash(str, len);
+    R3PoolSlot * s = r3_pool_slot(pool->slots, pool->mask, h, str, len);
+    const char * copy;
+
+    if (s->str) {
+        pool->hits++;
+        return s->str;
+    }
+
+    copy = r3_arena_strndup(pool->bytes, str, len);
+    s->hash = h;
+    s->len  = len;
+    s->str  = copy;
+
+    if (++pool->size * 4 > (pool->mask + 1) * 3) {
+        r3_pool_rehash(pool, (pool->mask + 1) * 2);
+    }
+    return copy;
+}
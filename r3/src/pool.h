@@ -0,0 +1,54 @@
+/*
+ * pool.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_POOL_H
+#define R3_POOL_H
+
+#include <stdint.h>
+#include "r3.h"
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _pool_slot {
+    uint32_t hash;
+    uint32_t len;
+    const char * str;        // NULL for free slots
+} R3PoolSlot;
+
+/**
+ * Interned strings of a tree, like the paths of the routes, which the
+ * patterns of the edges and the slugs point into, and the hosts. Equal
+ * strings are stored once. The bytes have an arena of their own, so they
+ * are packed next to each other and not between the nodes.
+ *
+ * Strings are never removed, a deleted route leaves its path behind for
+ * the edges of the other routes, which may still point into it.
+ */
+struct _pool {
+    R3Arena * bytes;
+    R3PoolSlot * slots;
+    uint32_t mask;           // slots - 1, a power of two minus one
+    uint32_t size;           // distinct strings
+
+    size_t hits;             // interned strings which were already there
+};
+
+R3Pool * r3_pool_create(void);
+
+void r3_pool_free(R3Pool * pool);
+
+/**
+ * Return the copy of the string in the pool, which is null-terminated.
+ */
+const char * r3_pool_intern(R3Pool * pool, const char * str, unsigned int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_POOL_H */
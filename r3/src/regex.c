@@ -0,0 +1,948 @@
+/*
+ * regex.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include "asprintf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "r3.h"
+#include "regex.h"
+
+enum { RE_CLASS, RE_ANY, RE_BOL, RE_EOL, RE_JMP, RE_SPLIT, RE_SAVE, RE_MATCH };
+
+typedef struct {
+    uint32_t op;
+    uint32_t x;              // class index, save slot or jump target
+    uint32_t y;              // second target of a split
+} R3RegexInst;
+
+typedef struct {
+    uint32_t pc;             // first instruction
+    uint32_t insts;          // number of instructions
+    uint32_t first_group;    // global number of the first group
+    uint32_t groups;
+    uint32_t anchored;       // every path starts with ^
+} R3RegexAlt;
+
+struct _regex {
+    R3RegexInst * insts;
+    unsigned int insts_len;
+
+    r3_charclass * classes;
+    unsigned int classes_len;
+
+    R3RegexAlt * alts;
+    unsigned int alts_len;
+
+    unsigned int groups;
+};
+
+/* parser */
+
+enum { AST_EMPTY, AST_CLASS, AST_ANY, AST_BOL, AST_EOL, AST_CAT, AST_ALT, AST_REPEAT, AST_GROUP };
+
+typedef struct {
+    int type;
+    int left, right;         // children, right is unused for REPEAT and GROUP
+    int min, max;            // REPEAT, max is -1 when unbounded
+    int greedy;
+    unsigned int x;          // class index or group number
+} R3RegexAst;
+
+typedef struct {
+    const char * start;
+    const char * p;
+    const char * end;
+    const char * error;
+    unsigned int depth;
+    unsigned int groups;
+    uint32_t pc;             // first instruction of the current alternative
+
+    R3_VECTOR(R3RegexAst) ast;
+    R3_VECTOR(r3_charclass) classes;
+    R3_VECTOR(R3RegexInst) insts;
+} R3RegexParser;
+
+static int re_parse_alt(R3RegexParser * ps);
+
+static int re_node(R3RegexParser * ps, int type, int left, int right) {
+    R3RegexAst * a;
+
+    r3_vector_reserve(&ps->ast, ps->ast.size + 1);
+    a = ps->ast.entries + ps->ast.size;
+    memset(a, 0, sizeof(*a));
+    a->type  = type;
+    a->left  = left;
+    a->right = right;
+    return ps->ast.size++;
+}
+
+static unsigned int re_class_new(R3RegexParser * ps) {
+    r3_vector_reserve(&ps->classes, ps->classes.size + 1);
+    memset(ps->classes.entries + ps->classes.size, 0, sizeof(r3_charclass));
+    return ps->classes.size++;
+}
+
+static void re_class_set(r3_charclass * cls, unsigned char c) {
+    cls->bits[c >> 5] |= (uint32_t)1 << (c & 31);
+}
+
+static void re_class_range(r3_charclass * cls, unsigned char lo, unsigned char hi) {
+    unsigned int c;
+    for (c = lo; c <= hi; c++) {
+        re_class_set(cls, (unsigned char) c);
+    }
+}
+
+static void re_class_merge(r3_charclass * cls, const r3_charclass * other, int negate) {
+    unsigned int i;
+    for (i = 0; i < 8; i++) {
+        cls->bits[i] |= negate ? ~other->bits[i] : other->bits[i];
+    }
+}
+
+/**
+ * Fill cls with the class of a backslash escape like \d, returns 0 if the
+ * escape is not a class.
+ */
+static int re_escape_class(char c, r3_charclass * cls) {
+    r3_charclass tmp;
+
+    memset(&tmp, 0, sizeof(tmp));
+    switch (c | 0x20) {
+        case 'd':
+            tmp = r3_classes[R3_CLASS_DIGIT];
+            break;
+        case 'w':
+            tmp = r3_classes[R3_CLASS_ALNUM];
+            re_class_set(&tmp, '_');
+            break;
+        case 's':
+            re_class_range(&tmp, '\t', '\r');
+            re_class_set(&tmp, ' ');
+            break;
+        default:
+            return 0;
+    }
+    re_class_merge(cls, &tmp, c >= 'A' && c <= 'Z');
+    return 1;
+}
+
+static int re_hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') return (c | 0x20) - 'a' + 10;
+    return -1;
+}
+
+/**
+ * Parse the literal byte of an escape, the backslash is already consumed.
+ */
+static int re_escape_char(R3RegexParser * ps, unsigned char * out) {
+    char c = *ps->p++;
+    int hi, lo;
+
+    switch (c) {
+        case 'n': *out = '\n'; return 1;
+        case 't': *out = '\t'; return 1;
+        case 'r': *out = '\r'; return 1;
+        case 'f': *out = '\f'; return 1;
+        case 'v': *out = '\v'; return 1;
+        case 'x':
+            if (ps->end - ps->p < 2 || (hi = re_hex(ps->p[0])) < 0 || (lo = re_hex(ps->p[1])) < 0) {
+                ps->error = "invalid \\x escape";
+                return 0;
+            }
+            ps->p += 2;
+            *out = (unsigned char)(hi << 4 | lo);
+            return 1;
+    }
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        ps->error = "unsupported escape sequence";
+        return 0;
+    }
+    *out = (unsigned char) c;
+    return 1;
+}
+
+static int re_parse_class(R3RegexParser * ps) {
+    unsigned int idx = re_class_new(ps);
+    r3_charclass cls;
+    int negate = 0, first = 1;
+    unsigned char lo, hi;
+
+    memset(&cls, 0, sizeof(cls));
+
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+
+    for (;;) {
+        if (ps->p >= ps->end) {
+            ps->error = "missing terminating ] for character class";
+            return -1;
+        }
+        if (*ps->p == ']' && !first) {
+            ps->p++;
+            break;
+        }
+        first = 0;
+
+        if (*ps->p == '\\') {
+            if (++ps->p >= ps->end) {
+                ps->error = "\\ at end of pattern";
+                return -1;
+            }
+            if (re_escape_class(*ps->p, &cls)) {
+                ps->p++;
+                continue;
+            }
+            if (!re_escape_char(ps, &lo)) {
+                return -1;
+            }
+        } else {
+            lo = (unsigned char) *ps->p++;
+        }
+
+        hi = lo;
+        if (ps->end - ps->p >= 2 && *ps->p == '-' && ps->p[1] != ']') {
+            ps->p++;
+            if (*ps->p == '\\') {
+                if (++ps->p >= ps->end) {
+                    ps->error = "\\ at end of pattern";
+                    return -1;
+                }
+                if (!re_escape_char(ps, &hi)) {
+                    return -1;
+                }
+            } else {
+                hi = (unsigned char) *ps->p++;
+            }
+            if (hi < lo) {
+                ps->error = "range out of order in character class";
+                return -1;
+            }
+        }
+        re_class_range(&cls, lo, hi);
+    }
+
+    if (negate) {
+        r3_charclass all;
+        memset(&all, 0, sizeof(all));
+        re_class_merge(&all, &cls, 1);
+        cls = all;
+    }
+    ps->classes.entries[idx] = cls;
+
+    int n = re_node(ps, AST_CLASS, -1, -1);
+    ps->ast.entries[n].x = idx;
+    return n;
+}
+
+static int re_parse_atom(R3RegexParser * ps) {
+    unsigned char c = (unsigned char) *ps->p++;
+    unsigned int idx;
+    int n;
+
+    switch (c) {
+        case '(':
+            if (++ps->depth > R3_REGEX_MAX_DEPTH) {
+                ps->error = "parentheses are too deeply nested";
+                return -1;
+            }
+            if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':') {
+                ps->p += 2;
+                n = re_parse_alt(ps);
+            } else if (ps->p < ps->end && *ps->p == '?') {
+                ps->error = "unsupported group";
+                return -1;
+            } else {
+                unsigned int group = ++ps->groups;
+                n = re_parse_alt(ps);
+                if (n >= 0) {
+                    n = re_node(ps, AST_GROUP, n, -1);
+                    ps->ast.entries[n].x = group;
+                }
+            }
+            if (n < 0) {
+                return -1;
+            }
+            if (ps->p >= ps->end || *ps->p != ')') {
+                ps->error = "missing closing parenthesis";
+                return -1;
+            }
+            ps->p++;
+            ps->depth--;
+            return n;
+        case '[':
+            return re_parse_class(ps);
+        case '.':
+            return re_node(ps, AST_ANY, -1, -1);
+        case '^':
+            return re_node(ps, AST_BOL, -1, -1);
+        case '$':
+            return re_node(ps, AST_EOL, -1, -1);
+        case '*':
+        case '+':
+        case '?':
+            ps->error = "quantifier does not follow a repeatable item";
+            return -1;
+        case '\\':
+            if (ps->p >= ps->end) {
+                ps->error = "\\ at end of pattern";
+                return -1;
+            }
+            idx = re_class_new(ps);
+            if (re_escape_class(*ps->p, ps->classes.entries + idx)) {
+                ps->p++;
+            } else if (re_escape_char(ps, &c)) {
+                re_class_set(ps->classes.entries + idx, c);
+            } else {
+                return -1;
+            }
+            break;
+        default:
+            idx = re_class_new(ps);
+            re_class_set(ps->classes.entries + idx, c);
+            break;
+    }
+
+    n = re_node(ps, AST_CLASS, -1, -1);
+    ps->ast.entries[n].x = idx;
+    return n;
+}
+
+/**
+ * Parse a {n}, {n,} or {n,m} quantifier. Like PCRE, a brace which does
+ * not start a valid quantifier is a literal.
+ */
+static int re_parse_braces(R3RegexParser * ps, int * min, int * max) {
+    const char * p = ps->p + 1;
+    long lo = 0, hi;
+    int digits = 0;
+
+    while (p < ps->end && *p >= '0' && *p <= '9' && lo <= R3_REGEX_MAX_REPEAT) {
+        lo = lo * 10 + (*p++ - '0');
+        digits++;
+    }
+    if (!digits || p >= ps->end) {
+        return 0;
+    }
+    hi = lo;
+    if (*p == ',') {
+        p++;
+        hi = -1;
+        if (p < ps->end && *p >= '0' && *p <= '9') {
+            hi = 0;
+            while (p < ps->end && *p >= '0' && *p <= '9' && hi <= R3_REGEX_MAX_REPEAT) {
+                hi = hi * 10 + (*p++ - '0');
+            }
+        }
+    }
+    if (p >= ps->end || *p != '}') {
+        return 0;
+    }
+    if (lo > R3_REGEX_MAX_REPEAT || hi > R3_REGEX_MAX_REPEAT) {
+        ps->error = "number too big in {} quantifier";
+        return -1;
+    }
+    if (hi >= 0 && hi < lo) {
+        ps->error = "numbers out of order in {} quantifier";
+        return -1;
+    }
+    ps->p = p + 1;
+    *min = (int) lo;
+    *max = (int) hi;
+    return 1;
+}
+
+static int re_parse_quantifier(R3RegexParser * ps, int * min, int * max) {
+    if (ps->p >= ps->end) {
+        return 0;
+    }
+    switch (*ps->p) {
+        case '*': *min = 0; *max = -1; ps->p++; return 1;
+        case '+': *min = 1; *max = -1; ps->p++; return 1;
+        case '?': *min = 0; *max = 1;  ps->p++; return 1;
+        case '{': return re_parse_braces(ps, min, max);
+    }
+    return 0;
+}
+
+static int re_parse_repeat(R3RegexParser * ps) {
+    int n = re_parse_atom(ps);
+    int min, max, r;
+
+    if (n < 0) {
+        return -1;
+    }
+    if ((r = re_parse_quantifier(ps, &min, &max)) <= 0) {
+        return r < 0 ? -1 : n;
+    }
+
+    n = re_node(ps, AST_REPEAT, n, -1);
+    ps->ast.entries[n].min = min;
+    ps->ast.entries[n].max = max;
+    ps->ast.entries[n].greedy = 1;
+
+    if (ps->p < ps->end && *ps->p == '?') {
+        ps->ast.entries[n].greedy = 0;
+        ps->p++;
+    } else if (ps->p < ps->end && *ps->p == '+') {
+        ps->error = "possessive quantifiers are not supported";
+        return -1;
+    }
+
+    // a{2}{3} is valid in PCRE, but rarely meant
+    if ((r = re_parse_quantifier(ps, &min, &max)) != 0) {
+        if (r > 0) {
+            ps->error = "multiple quantifiers are not supported";
+        }
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * Parse a sequence into a right leaning chain of AST_CAT nodes, so that
+ * long literals do not nest deeply.
+ */
+static int re_parse_cat(R3RegexParser * ps) {
+    int n = -1, tail = -1, m;
+
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        if ((m = re_parse_repeat(ps)) < 0) {
+            return -1;
+        }
+        if (n < 0) {
+            n = m;
+        } else if (tail < 0) {
+            n = tail = re_node(ps, AST_CAT, n, m);
+        } else {
+            m = re_node(ps, AST_CAT, ps->ast.entries[tail].right, m);
+            ps->ast.entries[tail].right = m;
+            tail = m;
+        }
+    }
+    return n < 0 ? re_node(ps, AST_EMPTY, -1, -1) : n;
+}
+
+/**
+ * Parse an alternation into a right leaning chain of AST_ALT nodes, whose
+ * left sides are the alternatives.
+ */
+static int re_parse_alt(R3RegexParser * ps) {
+    int n = re_parse_cat(ps), tail = -1, m;
+
+    while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        if ((m = re_parse_cat(ps)) < 0) {
+            return -1;
+        }
+        if (tail < 0) {
+            n = tail = re_node(ps, AST_ALT, n, m);
+        } else {
+            m = re_node(ps, AST_ALT, ps->ast.entries[tail].right, m);
+            ps->ast.entries[tail].right = m;
+            tail = m;
+        }
+    }
+    return n;
+}
+
+/* code generation */
+
+static uint32_t re_emit(R3RegexParser * ps, uint32_t op, uint32_t x, uint32_t y) {
+    R3RegexInst * i;
+
+    if (ps->insts.size - ps->pc >= R3_REGEX_MAX_INSTS) {
+        ps->error = "regular expression is too large";
+        return ps->insts.size;
+    }
+    r3_vector_reserve(&ps->insts, ps->insts.size + 1);
+    i = ps->insts.entries + ps->insts.size;
+    i->op = op;
+    i->x  = x;
+    i->y  = y;
+    return ps->insts.size++;
+}
+
+#define re_pc(ps) ((uint32_t)(ps)->insts.size)
+
+static void re_patch(R3RegexParser * ps, uint32_t at, uint32_t x, uint32_t y) {
+    if (at < ps->insts.size) {
+        ps->insts.entries[at].x = x;
+        ps->insts.entries[at].y = y;
+    }
+}
+
+/**
+ * Emit the code of an AST node, save slots are local to the alternative:
+ * group g is stored in the slots 2 * (g - base) and 2 * (g - base) + 1.
+ */
+static void re_gen(R3RegexParser * ps, int n, unsigned int base) {
+    const R3RegexAst * a = ps->ast.entries + n;
+    uint32_t split, jmp, loop;
+    int i;
+
+    if (ps->error) {
+        return;
+    }
+
+    switch (a->type) {
+        case AST_EMPTY:
+            break;
+        case AST_CLASS:
+            re_emit(ps, RE_CLASS, a->x, 0);
+            break;
+        case AST_ANY:
+            re_emit(ps, RE_ANY, 0, 0);
+            break;
+        case AST_BOL:
+            re_emit(ps, RE_BOL, 0, 0);
+            break;
+        case AST_EOL:
+            re_emit(ps, RE_EOL, 0, 0);
+            break;
+        case AST_CAT:
+            for (; a->type == AST_CAT; a = ps->ast.entries + a->right) {
+                re_gen(ps, a->left, base);
+            }
+            re_gen(ps, a - ps->ast.entries, base);
+            break;
+        case AST_ALT:
+            // the jumps to the end are chained through their x target
+            jmp = UINT32_MAX;
+            for (; a->type == AST_ALT && !ps->error; a = ps->ast.entries + a->right) {
+                split = re_emit(ps, RE_SPLIT, 0, 0);
+                re_gen(ps, a->left, base);
+                jmp = re_emit(ps, RE_JMP, jmp, 0);
+                re_patch(ps, split, split + 1, re_pc(ps));
+            }
+            re_gen(ps, a - ps->ast.entries, base);
+            while (jmp != UINT32_MAX && !ps->error) {
+                loop = ps->insts.entries[jmp].x;
+                re_patch(ps, jmp, re_pc(ps), 0);
+                jmp = loop;
+            }
+            break;
+        case AST_GROUP:
+            re_emit(ps, RE_SAVE, 2 * (a->x - base), 0);
+            re_gen(ps, a->left, base);
+            re_emit(ps, RE_SAVE, 2 * (a->x - base) + 1, 0);
+            break;
+        case AST_REPEAT:
+            for (i = 0; i < a->min; i++) {
+                re_gen(ps, a->left, base);
+            }
+            if (a->max < 0) {
+                loop = re_emit(ps, RE_SPLIT, 0, 0);
+                re_gen(ps, a->left, base);
+                re_emit(ps, RE_JMP, loop, 0);
+                if (a->greedy) {
+                    re_patch(ps, loop, loop + 1, re_pc(ps));
+                } else {
+                    re_patch(ps, loop, re_pc(ps), loop + 1);
+                }
+                break;
+            }
+            // x{2,4} is xx(x(x)?)?, all optional parts skip to the end.
+            // Until then the splits are chained through their y target.
+            split = UINT32_MAX;
+            for (i = 0; i < a->max - a->min && !ps->error; i++) {
+                split = re_emit(ps, RE_SPLIT, 0, split);
+                re_gen(ps, a->left, base);
+            }
+            while (split != UINT32_MAX && !ps->error) {
+                jmp = ps->insts.entries[split].y;
+                if (a->greedy) {
+                    re_patch(ps, split, split + 1, re_pc(ps));
+                } else {
+                    re_patch(ps, split, re_pc(ps), split + 1);
+                }
+                split = jmp;
+            }
+            break;
+    }
+}
+
+static int re_anchored(const R3RegexParser * ps, int n) {
+    const R3RegexAst * a = ps->ast.entries + n;
+
+    switch (a->type) {
+        case AST_BOL:
+            return 1;
+        case AST_CAT:
+        case AST_GROUP:
+            return re_anchored(ps, a->left);
+        case AST_ALT:
+            for (; a->type == AST_ALT; a = ps->ast.entries + a->right) {
+                if (!re_anchored(ps, a->left)) {
+                    return 0;
+                }
+            }
+            return re_anchored(ps, a - ps->ast.entries);
+        case AST_REPEAT:
+            return a->min > 0 && re_anchored(ps, a->left);
+    }
+    return 0;
+}
+
+static unsigned int re_count_groups(const R3RegexParser * ps, int n) {
+    const R3RegexAst * a = ps->ast.entries + n;
+    unsigned int cnt = 0;
+
+    for (; a->type == AST_CAT || a->type == AST_ALT; a = ps->ast.entries + a->right) {
+        cnt += re_count_groups(ps, a->left);
+    }
+    switch (a->type) {
+        case AST_GROUP:
+            return cnt + 1 + re_count_groups(ps, a->left);
+        case AST_REPEAT:
+            return cnt + re_count_groups(ps, a->left);
+    }
+    return cnt;
+}
+
+static void re_parser_free(R3RegexParser * ps) {
+    free(ps->ast.entries);
+    free(ps->classes.entries);
+    free(ps->insts.entries);
+}
+
+/**
+ * Compile a pattern. Returns NULL and sets errstr if it is invalid or uses
+ * features the engine does not support, e.g. backreferences or lookaround.
+ */
+R3Regex * r3_regex_compile(const char * pattern, unsigned int len, char **errstr) {
+    R3RegexParser ps;
+    R3Regex * re;
+    R3_VECTOR(R3RegexAlt) alts;
+    int root, n;
+    unsigned int groups = 0;
+
+    memset(&ps, 0, sizeof(ps));
+    memset(&alts, 0, sizeof(alts));
+    ps.start = ps.p = pattern;
+    ps.end   = pattern + len;
+
+    root = re_parse_alt(&ps);
+    if (root >= 0 && !ps.error && ps.p < ps.end) {
+        ps.error = "unmatched closing parenthesis";
+    }
+
+    // emit one program per top level alternative
+    for (n = root; !ps.error; ) {
+        int alt = ps.ast.entries[n].type == AST_ALT ? ps.ast.entries[n].left : n;
+        R3RegexAlt * a;
+
+        r3_vector_reserve(&alts, alts.size + 1);
+        a = alts.entries + alts.size++;
+        a->pc          = ps.pc = re_pc(&ps);
+        a->first_group = groups + 1;
+        a->groups      = re_count_groups(&ps, alt);
+        a->anchored    = re_anchored(&ps, alt);
+
+        re_emit(&ps, RE_SAVE, 0, 0);
+        re_gen(&ps, alt, groups);
+        re_emit(&ps, RE_SAVE, 1, 0);
+        re_emit(&ps, RE_MATCH, 0, 0);
+
+        a->insts = re_pc(&ps) - a->pc;
+        groups  += a->groups;
+
+        if (ps.ast.entries[n].type != AST_ALT) {
+            break;
+        }
+        n = ps.ast.entries[n].right;
+    }
+
+    if (ps.error) {
+        if (errstr) {
+            int r = asprintf(errstr, "Regex compilation failed at offset %ld: %s, pattern: %.*s",
+                (long)(ps.p - ps.start), ps.error, (int)len, pattern);
+            if (r < 0) {
+                *errstr = NULL; /* the content of errstr is undefined when asprintf() fails */
+            }
+        }
+        free(alts.entries);
+        re_parser_free(&ps);
+        return NULL;
+    }
+
+    assert(groups == ps.groups);
+
+    re = r3_mem_alloc(sizeof(R3Regex));
+    re->insts       = ps.insts.entries;
+    re->insts_len   = ps.insts.size;
+    re->classes     = ps.classes.entries;
+    re->classes_len = ps.classes.size;
+    re->alts        = alts.entries;
+    re->alts_len    = alts.size;
+    re->groups      = groups;
+
+    free(ps.ast.entries);
+    return re;
+}
+
+void r3_regex_free(R3Regex * re) {
+    if (!re) {
+        return;
+    }
+    free(re->insts);
+    free(re->classes);
+    free(re->alts);
+    free(re);
+}
+
+unsigned int r3_regex_groups(const R3Regex * re) {
+    return re->groups;
+}
+
+/* matching */
+
+#define RE_RESTORE 0x80000000u
+
+typedef struct {
+    uint32_t len;
+    uint32_t * pcs;
+    uint32_t * caps;         // slots of each thread
+} R3RegexList;
+
+typedef struct {
+    const R3Regex * re;
+    const R3RegexAlt * alt;
+    const char * subject;
+    uint32_t len;
+    uint32_t slots;
+    uint32_t gen;
+    uint32_t * marks;        // generation in which a pc was last added
+    uint32_t * stack;        // pairs of pc or RESTORE | slot, and the old value
+    uint32_t * work;         // slots of the thread being followed
+} R3RegexVM;
+
+/**
+ * Layout of the scratch memory for an alternative with n instructions:
+ * marks[n], 2 lists of pcs[n] and caps[n * slots], stack[2 * (2n + 1)],
+ * work[slots] and the slots of the match.
+ */
+static unsigned int re_scratch_words(uint32_t insts, uint32_t slots) {
+    return insts + 2 * (insts + insts * slots) + 2 * (2 * insts + 1) + 2 * slots;
+}
+
+unsigned int r3_regex_scratch_size(const R3Regex * re) {
+    unsigned int i, words, max = 0;
+
+    for (i = 0; i < re->alts_len; i++) {
+        words = re_scratch_words(re->alts[i].insts, 2 * (re->alts[i].groups + 1));
+        if (words > max) {
+            max = words;
+        }
+    }
+    return max * sizeof(uint32_t);
+}
+
+static inline int re_at_eol(const R3RegexVM * vm, uint32_t sp) {
+    return sp == vm->len || (sp + 1 == vm->len && vm->subject[sp] == '\n');
+}
+
+/**
+ * Follow the empty transitions from pc and append the threads which wait
+ * for input to the list, in priority order.
+ */
+static void re_add_thread(R3RegexVM * vm, R3RegexList * l, uint32_t pc, uint32_t sp) {
+    const R3RegexInst * insts = vm->re->insts + vm->alt->pc;
+    uint32_t top = 0;
+
+    vm->stack[top++] = pc;
+    vm->stack[top++] = 0;
+
+    while (top) {
+        uint32_t val = vm->stack[--top];
+        uint32_t cur = vm->stack[--top];
+        const R3RegexInst * i;
+
+        if (cur & RE_RESTORE) {
+            vm->work[cur & ~RE_RESTORE] = val;
+            continue;
+        }
+        if (vm->marks[cur] == vm->gen) {
+            continue;
+        }
+        vm->marks[cur] = vm->gen;
+
+        i = insts + cur;
+        switch (i->op) {
+            case RE_JMP:
+                vm->stack[top++] = i->x - vm->alt->pc;
+                vm->stack[top++] = 0;
+                break;
+            case RE_SPLIT:
+                // the second branch is pushed first, so the first one wins
+                vm->stack[top++] = i->y - vm->alt->pc;
+                vm->stack[top++] = 0;
+                vm->stack[top++] = i->x - vm->alt->pc;
+                vm->stack[top++] = 0;
+                break;
+            case RE_SAVE:
+                vm->stack[top++] = RE_RESTORE | i->x;
+                vm->stack[top++] = vm->work[i->x];
+                vm->work[i->x] = sp;
+                vm->stack[top++] = cur + 1;
+                vm->stack[top++] = 0;
+                break;
+            case RE_BOL:
+                if (sp == 0) {
+                    vm->stack[top++] = cur + 1;
+                    vm->stack[top++] = 0;
+                }
+                break;
+            case RE_EOL:
+                if (re_at_eol(vm, sp)) {
+                    vm->stack[top++] = cur + 1;
+                    vm->stack[top++] = 0;
+                }
+                break;
+            default:
+                l->pcs[l->len] = cur;
+                memcpy(l->caps + l->len * vm->slots, vm->work, vm->slots * sizeof(uint32_t));
+                l->len++;
+                break;
+        }
+    }
+}
+
+static void re_start_thread(R3RegexVM * vm, R3RegexList * l, uint32_t sp) {
+    uint32_t s;
+    for (s = 0; s < vm->slots; s++) {
+        vm->work[s] = R3_REGEX_UNSET;
+    }
+    re_add_thread(vm, l, 0, sp);
+}
+
+/**
+ * Run one alternative, the leftmost match wins and among matches with the
+ * same start the one with the highest priority.
+ */
+static int re_run(R3RegexVM * vm, void * scratch, uint32_t ** caps) {
+    const R3RegexInst * insts = vm->re->insts + vm->alt->pc;
+    uint32_t n = vm->alt->insts;
+    uint32_t * mem = scratch;
+    R3RegexList lists[2], * clist, * nlist, * tmp;
+    uint32_t sp, t;
+    int matched = 0;
+
+    vm->marks = mem;
+    mem += n;
+    for (t = 0; t < 2; t++) {
+        lists[t].len  = 0;
+        lists[t].pcs  = mem;
+        mem += n;
+        lists[t].caps = mem;
+        mem += n * vm->slots;
+    }
+    vm->stack = mem;
+    mem += 2 * (2 * n + 1);
+    vm->work = mem;
+    mem += vm->slots;
+    *caps = mem;
+
+    memset(vm->marks, 0, n * sizeof(uint32_t));
+    vm->gen = 1;
+
+    clist = lists;
+    nlist = lists + 1;
+    re_start_thread(vm, clist, 0);
+
+    for (sp = 0; ; sp++) {
+        unsigned char c = sp < vm->len ? (unsigned char) vm->subject[sp] : 0;
+
+        vm->gen++;
+        nlist->len = 0;
+
+        for (t = 0; t < clist->len; t++) {
+            const R3RegexInst * i = insts + clist->pcs[t];
+            uint32_t * tcaps = clist->caps + t * vm->slots;
+
+            if (i->op == RE_MATCH) {
+                memcpy(*caps, tcaps, vm->slots * sizeof(uint32_t));
+                matched = 1;
+                break; // threads with a lower priority are cut off
+            }
+            if (sp >= vm->len) {
+                continue;
+            }
+            if ((i->op == RE_CLASS && r3_class_has(vm->re->classes + i->x, c)) || (i->op == RE_ANY && c != '\n')) {
+                memcpy(vm->work, tcaps, vm->slots * sizeof(uint32_t));
+                re_add_thread(vm, nlist, clist->pcs[t] + 1, sp + 1);
+            }
+        }
+
+        if (sp >= vm->len) {
+            break;
+        }
+        if (!matched && !vm->alt->anchored) {
+            re_start_thread(vm, nlist, sp + 1);
+        }
+        if (!nlist->len && (matched || vm->alt->anchored)) {
+            break;
+        }
+
+        tmp = clist;
+        clist = nlist;
+        nlist = tmp;
+    }
+    return matched;
+}
+
+int r3_regex_match(const R3Regex * re, const char * subject, unsigned int len, uint32_t * ov, void * scratch) {
+    R3RegexVM vm;
+    uint32_t * caps;
+    uint32_t best = R3_REGEX_UNSET;
+    unsigned int i, g, rc = 0;
+
+    for (i = 0; i < 2 * (re->groups + 1); i++) {
+        ov[i] = R3_REGEX_UNSET;
+    }
+
+    vm.re      = re;
+    vm.subject = subject;
+    vm.len     = len;
+
+    for (i = 0; i < re->alts_len && best; i++) {
+        const R3RegexAlt * alt = re->alts + i;
+
+        vm.alt   = alt;
+        vm.slots = 2 * (alt->groups + 1);
+
+        // an earlier start wins, otherwise the earlier alternative
+        if (!re_run(&vm, scratch, &caps) || caps[0] >= best) {
+            continue;
+        }
+
+        best = caps[0];
+        for (g = 0; g < 2 * (re->groups + 1); g++) {
+            ov[g] = R3_REGEX_UNSET;
+        }
+        ov[0] = caps[0];
+        ov[1] = caps[1];
+        for (g = 0; g < alt->groups; g++) {
+            ov[2 * (alt->first_group + g)]     = caps[2 * (g + 1)];
+            ov[2 * (alt->first_group + g) + 1] = caps[2 * (g + 1) + 1];
+        }
+    }
+
+    if (best == R3_REGEX_UNSET) {
+        return -1;
+    }
+    for (g = 0; g <= re->groups; g++) {
+        if (ov[2 * g] != R3_REGEX_UNSET) {
+            rc = g + 1;
+        }
+    }
+    return (int) rc;
+}
@@ -0,0 +1,67 @@
+/*
+ * regex.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_REGEX_H
+#define R3_REGEX_H
+
+#include <stdint.h>
+#include "r3.h"
+#include "scan.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A small regex engine for the slug patterns, used when the gem is built
+ * without PCRE. It supports literals, escapes (\d \w \s and their negations),
+ * classes, the dot, the quantifiers * + ? {n} {n,} {n,m} (also lazy),
+ * capturing and non-capturing groups, alternation and the anchors ^ and $.
+ *
+ * Patterns are compiled into a program per top level alternative which
+ * runs on a Pike VM, so the time to match is linear in the length of the
+ * subject. The results follow the leftmost-first rules of PCRE, except for
+ * loops whose body can match the empty string, e.g. (a|)+.
+ *
+ * R3Regex is declared in r3.h, as nodes hold the compiled pattern.
+ */
+
+// ovector value of a group which did not participate in the match
+#define R3_REGEX_UNSET UINT32_MAX
+
+// upper bounds for the size of a compiled pattern, the instructions are
+// counted per top level alternative
+#define R3_REGEX_MAX_INSTS  65536
+#define R3_REGEX_MAX_REPEAT 1000
+#define R3_REGEX_MAX_DEPTH  64
+
+R3Regex * r3_regex_compile(const char * pattern, unsigned int len, char **errstr);
+
+void r3_regex_free(R3Regex * re);
+
+/**
+ * Number of capture groups, not counting the whole match.
+ */
+unsigned int r3_regex_groups(const R3Regex * re);
+
+/**
+ * Bytes of scratch memory r3_regex_match needs for this pattern.
+ */
+unsigned int r3_regex_scratch_size(const R3Regex * re);
+
+/**
+ * Match the subject and store the offsets of the whole match and of the
+ * groups into ov, which holds 2 * (groups + 1) entries.
+ *
+ * Returns one more than the highest group that was set like pcre2_match,
+ * or -1 if the subject does not match.
+ */
+int r3_regex_match(const R3Regex * re, const char * subject, unsigned int len, uint32_t * ov, void * scratch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_REGEX_H */
@@ -0,0 +1,290 @@
+/*
+ * scan.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <string.h>
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define R3_SCAN_X86 1
+# define R3_SCAN_AVX2 1
+# define R3_TARGET(t) __attribute__((target(t)))
+# include <immintrin.h>
+# define r3_ctz(x) __builtin_ctz(x)
+#elif defined(_MSC_VER) && defined(_M_X64)
+# define R3_SCAN_X86 1
+# define R3_TARGET(t)
+# include <intrin.h>
+# include <emmintrin.h>
+static inline unsigned int r3_ctz(unsigned int x) {
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (unsigned int)i;
+}
+#endif
+
+const r3_charclass r3_classes[R3_CLASS_BUILTIN] = {
+    // R3_CLASS_DIGIT: 0-9
+    {{ 0, 0x03FF0000, 0, 0, 0, 0, 0, 0 }},
+    // R3_CLASS_ALPHA: A-Z a-z
+    {{ 0, 0, 0x07FFFFFE, 0x07FFFFFE, 0, 0, 0, 0 }},
+    // R3_CLASS_ALNUM: 0-9 A-Z a-z
+    {{ 0, 0x03FF0000, 0x07FFFFFE, 0x07FFFFFE, 0, 0, 0, 0 }},
+    // R3_CLASS_HEX: 0-9 a-f
+    {{ 0, 0x03FF0000, 0, 0x0000007E, 0, 0, 0, 0 }},
+    // R3_CLASS_XDIGIT: 0-9 A-F a-f
+    {{ 0, 0x03FF0000, 0x0000007E, 0x0000007E, 0, 0, 0, 0 }},
+    // R3_CLASS_IDENT: - 0-9 A-Z _ a-z
+    {{ 0, 0x03FF2000, 0x87FFFFFE, 0x07FFFFFE, 0, 0, 0, 0 }},
+};
+
+static const char * r3_scan_byte_scalar(const char * p, const char * end, char c) {
+    while (p < end && *p != c) p++;
+    return p;
+}
+
+static int r3_scan_equal_scalar(const char * a, const char * b, unsigned int n) {
+    return memcmp(a, b, n) == 0;
+}
+
+static const char * r3_span_digit_scalar(const char * p, const char * end) {
+    return r3_scan_class(p, end, r3_classes + R3_CLASS_DIGIT);
+}
+
+static const char * r3_span_alpha_scalar(const char * p, const char * end) {
+    return r3_scan_class(p, end, r3_classes + R3_CLASS_ALPHA);
+}
+
+static const char * r3_span_alnum_scalar(const char * p, const char * end) {
+    return r3_scan_class(p, end, r3_classes + R3_CLASS_ALNUM);
+}
+
+static const char * r3_span_hex_scalar(const char * p, const char * end) {
+    return r3_scan_class(p, end, r3_classes + R3_CLASS_HEX);
+}
+
+static const char * r3_span_xdigit_scalar(const char * p, const char * end) {
+    return r3_scan_class(p, end, r3_classes + R3_CLASS_XDIGIT);
+}
+
+static const char * r3_span_ident_scalar(const char * p, const char * end) {
+    return r3_scan_class(p, end, r3_classes + R3_CLASS_IDENT);
+}
+
+static const r3_scan_kernels_t r3_scan_scalar = {
+    "scalar",
+    r3_scan_byte_scalar,
+    r3_scan_equal_scalar,
+    { r3_span_digit_scalar, r3_span_alpha_scalar, r3_span_alnum_scalar,
+      r3_span_hex_scalar, r3_span_xdigit_scalar, r3_span_ident_scalar }
+};
+
+#ifdef R3_SCAN_X86
+R3_TARGET("sse2")
+static const char * r3_scan_byte_sse2(const char * p, const char * end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return p + r3_ctz(mask);
+        }
+    }
+    return r3_scan_byte_scalar(p, end, c);
+}
+
+R3_TARGET("sse2")
+static int r3_scan_equal_sse2(const char * a, const char * b, unsigned int n) {
+    for (; n >= 16; a += 16, b += 16, n -= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) a);
+        __m128i y = _mm_loadu_si128((const __m128i *) b);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) {
+            return 0;
+        }
+    }
+    return r3_scan_equal_scalar(a, b, n);
+}
+
+/**
+ * Unsigned range check lo <= x <= hi for each byte: x - lo wraps around
+ * for bytes below lo, so min(x - lo, hi - lo) == x - lo only inside.
+ */
+#define R3_IN_RANGE_SSE2(x, lo, hi) \
+    _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(x, _mm_set1_epi8(lo)), _mm_set1_epi8((hi) - (lo))), _mm_sub_epi8(x, _mm_set1_epi8(lo)))
+
+#define R3_DIGIT_SSE2(x) R3_IN_RANGE_SSE2(x, '0', '9')
+#define R3_ALPHA_SSE2(x) R3_IN_RANGE_SSE2(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z')
+#define R3_ALNUM_SSE2(x) _mm_or_si128(R3_DIGIT_SSE2(x), R3_ALPHA_SSE2(x))
+#define R3_HEX_SSE2(x)    _mm_or_si128(R3_DIGIT_SSE2(x), R3_IN_RANGE_SSE2(x, 'a', 'f'))
+#define R3_XDIGIT_SSE2(x) _mm_or_si128(R3_DIGIT_SSE2(x), R3_IN_RANGE_SSE2(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'f'))
+#define R3_IDENT_SSE2(x)  _mm_or_si128(R3_ALNUM_SSE2(x), \
+    _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('_')), _mm_cmpeq_epi8(x, _mm_set1_epi8('-'))))
+
+#define R3_SPAN_SSE2(name, test)                                                         \
+    R3_TARGET("sse2")                                                                    \
+    static const char * r3_span_##name##_sse2(const char * p, const char * end) {       \
+        for (; end - p >= 16; p += 16) {                                                 \
+            __m128i x = _mm_loadu_si128((const __m128i *) p);                            \
+            unsigned int mask = (unsigned int) _mm_movemask_epi8(test(x)) ^ 0xFFFFu;     \
+            if (mask) {                                                                  \
+                return p + r3_ctz(mask);                                                 \
+            }                                                                            \
+        }                                                                                \
+        return r3_span_##name##_scalar(p, end);                                          \
+    }
+
+R3_SPAN_SSE2(digit, R3_DIGIT_SSE2)
+R3_SPAN_SSE2(alpha, R3_ALPHA_SSE2)
+R3_SPAN_SSE2(alnum, R3_ALNUM_SSE2)
+R3_SPAN_SSE2(hex, R3_HEX_SSE2)
+R3_SPAN_SSE2(xdigit, R3_XDIGIT_SSE2)
+R3_SPAN_SSE2(ident, R3_IDENT_SSE2)
+
+static const r3_scan_kernels_t r3_scan_sse2 = {
+    "sse2",
+    r3_scan_byte_sse2,
+    r3_scan_equal_sse2,
+    { r3_span_digit_sse2, r3_span_alpha_sse2, r3_span_alnum_sse2,
+      r3_span_hex_sse2, r3_span_xdigit_sse2, r3_span_ident_sse2 }
+};
+#endif
+
+#ifdef R3_SCAN_AVX2
+R3_TARGET("avx2")
+static const char * r3_scan_byte_avx2(const char * p, const char * end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) p);
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return p + r3_ctz(mask);
+        }
+    }
+    return r3_scan_byte_sse2(p, end, c);
+}
+
+R3_TARGET("avx2")
+static int r3_scan_equal_avx2(const char * a, const char * b, unsigned int n) {
+    for (; n >= 32; a += 32, b += 32, n -= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) a);
+        __m256i y = _mm256_loadu_si256((const __m256i *) b);
+        if ((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xFFFFFFFFu) {
+            return 0;
+        }
+    }
+    return r3_scan_equal_sse2(a, b, n);
+}
+
+#define R3_IN_RANGE_AVX2(x, lo, hi) \
+    _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(x, _mm256_set1_epi8(lo)), _mm256_set1_epi8((hi) - (lo))), _mm256_sub_epi8(x, _mm256_set1_epi8(lo)))
+
+#define R3_DIGIT_AVX2(x) R3_IN_RANGE_AVX2(x, '0', '9')
+#define R3_ALPHA_AVX2(x) R3_IN_RANGE_AVX2(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z')
+#define R3_ALNUM_AVX2(x) _mm256_or_si256(R3_DIGIT_AVX2(x), R3_ALPHA_AVX2(x))
+#define R3_HEX_AVX2(x)    _mm256_or_si256(R3_DIGIT_AVX2(x), R3_IN_RANGE_AVX2(x, 'a', 'f'))
+#define R3_XDIGIT_AVX2(x) _mm256_or_si256(R3_DIGIT_AVX2(x), R3_IN_RANGE_AVX2(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'f'))
+#define R3_IDENT_AVX2(x)  _mm256_or_si256(R3_ALNUM_AVX2(x), \
+    _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('-'))))
+
+#define R3_SPAN_AVX2(name, test)                                                         \
+    R3_TARGET("avx2")                                                                    \
+    static const char * r3_span_##name##_avx2(const char * p, const char * end) {       \
+        for (; end - p >= 32; p += 32) {                                                 \
+            __m256i x = _mm256_loadu_si256((const __m256i *) p);                         \
+            unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(test(x));           \
+            if (mask) {                                                                  \
+                return p + r3_ctz(mask);                                                 \
+            }                                                                            \
+        }                                                                                \
+        return r3_span_##name##_sse2(p, end);                                            \
+    }
+
+R3_SPAN_AVX2(digit, R3_DIGIT_AVX2)
+R3_SPAN_AVX2(alpha, R3_ALPHA_AVX2)
+R3_SPAN_AVX2(alnum, R3_ALNUM_AVX2)
+R3_SPAN_AVX2(hex, R3_HEX_AVX2)
+R3_SPAN_AVX2(xdigit, R3_XDIGIT_AVX2)
+R3_SPAN_AVX2(ident, R3_IDENT_AVX2)
+
+static const r3_scan_kernels_t r3_scan_avx2 = {
+    "avx2",
+    r3_scan_byte_avx2,
+    r3_scan_equal_avx2,
+    { r3_span_digit_avx2, r3_span_alpha_avx2, r3_span_alnum_avx2,
+      r3_span_hex_avx2, r3_span_xdigit_avx2, r3_span_ident_avx2 }
+};
+#endif
+
+/**
+ * Pick the widest kernels the CPU supports. Each thread may run this once
+ * on first use, they all store the same pointer.
+ */
+static const r3_scan_kernels_t * r3_scan_resolve(void) {
+    const r3_scan_kernels_t * impl = &r3_scan_scalar;
+
+#if defined(R3_SCAN_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        impl = &r3_scan_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        impl = &r3_scan_sse2;
+    }
+#elif defined(R3_SCAN_X86)
+    impl = &r3_scan_sse2;
+#endif
+
+    r3_scan_impl = impl;
+    return impl;
+}
+
+static const char * r3_scan_byte_resolve(const char * p, const char * end, char c) {
+    return r3_scan_resolve()->byte(p, end, c);
+}
+
+static int r3_scan_equal_resolve(const char * a, const char * b, unsigned int n) {
+    return r3_scan_resolve()->equal(a, b, n);
+}
+
+static const char * r3_span_digit_resolve(const char * p, const char * end) {
+    return r3_scan_resolve()->span[R3_CLASS_DIGIT](p, end);
+}
+
+static const char * r3_span_alpha_resolve(const char * p, const char * end) {
+    return r3_scan_resolve()->span[R3_CLASS_ALPHA](p, end);
+}
+
+static const char * r3_span_alnum_resolve(const char * p, const char * end) {
+    return r3_scan_resolve()->span[R3_CLASS_ALNUM](p, end);
+}
+
+static const char * r3_span_hex_resolve(const char * p, const char * end) {
+    return r3_scan_resolve()->span[R3_CLASS_HEX](p, end);
+}
+
+static const char * r3_span_xdigit_resolve(const char * p, const char * end) {
+    return r3_scan_resolve()->span[R3_CLASS_XDIGIT](p, end);
+}
+
+static const char * r3_span_ident_resolve(const char * p, const char * end) {
+    return r3_scan_resolve()->span[R3_CLASS_IDENT](p, end);
+}
+
+static const r3_scan_kernels_t r3_scan_unresolved = {
+    "unresolved",
+    r3_scan_byte_resolve,
+    r3_scan_equal_resolve,
+    { r3_span_digit_resolve, r3_span_alpha_resolve, r3_span_alnum_resolve,
+      r3_span_hex_resolve, r3_span_xdigit_resolve, r3_span_ident_resolve }
+};
+
+const r3_scan_kernels_t * r3_scan_impl = &r3_scan_unresolved;
+
+const char * r3_scan_kernels(void) {
+    if (r3_scan_impl == &r3_scan_unresolved) {
+        r3_scan_resolve();
+    }
+    return r3_scan_impl->name;
+}
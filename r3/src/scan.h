@@ -0,0 +1,116 @@
+/*
+ * scan.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_SCAN_H
+#define R3_SCAN_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A set of bytes as a 256-bit bitmap. Unlike isdigit() and friends the
+ * classes do not depend on the locale of the process.
+ */
+typedef struct {
+    uint32_t bits[8];
+} r3_charclass;
+
+#define r3_class_has(cls, c) (((cls)->bits[(unsigned char)(c) >> 5] >> ((unsigned char)(c) & 31)) & 1)
+
+/**
+ * Built-in classes, the vectorized kernels know how to span them.
+ */
+enum { R3_CLASS_DIGIT, R3_CLASS_ALPHA, R3_CLASS_ALNUM, R3_CLASS_HEX, R3_CLASS_XDIGIT, R3_CLASS_IDENT, R3_CLASS_BUILTIN };
+
+extern const r3_charclass r3_classes[R3_CLASS_BUILTIN];
+
+/**
+ * Byte scanning kernels used by the matcher. The vectorized versions
+ * (SSE2, AVX2 on x86) are selected at runtime, other targets use the
+ * scalar fallback. None of them reads beyond the given bounds.
+ */
+typedef struct {
+    const char * name;
+    const char * (*byte)(const char * p, const char * end, char c);
+    int (*equal)(const char * a, const char * b, unsigned int n);
+    const char * (*span[R3_CLASS_BUILTIN])(const char * p, const char * end);
+} r3_scan_kernels_t;
+
+extern const r3_scan_kernels_t * r3_scan_impl;
+
+#define R3_SCAN_VECTOR_MIN 16
+
+/**
+ * Return a pointer to the first c in [p, end) or end if there is none.
+ */
+static inline const char * r3_scan_byte(const char * p, const char * end, char c) {
+    if (end - p < R3_SCAN_VECTOR_MIN) {
+        while (p < end && *p != c) p++;
+        return p;
+    }
+    return r3_scan_impl->byte(p, end, c);
+}
+
+/**
+ * Return 1 if the first n bytes of a and b are equal.
+ */
+static inline int r3_scan_equal(const char * a, const char * b, unsigned int n) {
+    if (n < R3_SCAN_VECTOR_MIN) {
+        while (n && *a == *b) { a++; b++; n--; }
+        return n == 0;
+    }
+    return r3_scan_impl->equal(a, b, n);
+}
+
+/**
+ * Return a pointer to the first byte in [p, end) which is not in the class.
+ */
+static inline const char * r3_scan_class(const char * p, const char * end, const r3_charclass * cls) {
+    while (p < end && r3_class_has(cls, *p)) p++;
+    return p;
+}
+
+/**
+ * Same as r3_scan_class for one of the built-in classes.
+ */
+static inline const char * r3_scan_builtin(const char * p, const char * end, unsigned int cls) {
+    if (end - p < R3_SCAN_VECTOR_MIN) {
+        return r3_scan_class(p, end, r3_classes + cls);
+    }
+    return r3_scan_impl->span[cls](p, end);
+}
+
+/**
+ * Return p + 36 if [p, end) starts with a UUID like
+ * 01234567-89ab-cdef-0123-456789abcdef whose digits are in the class,
+ * otherwise p.
+ */
+static inline const char * r3_scan_uuid(const char * p, const char * end, unsigned int cls) {
+    unsigned int i;
+
+    if (end - p < 36) {
+        return p;
+    }
+    for (i = 0; i < 36; i++) {
+        if (i == 8 || i == 13 || i == 18 || i == 23 ? p[i] != '-' : !r3_class_has(r3_classes + cls, p[i])) {
+            return p;
+        }
+    }
+    return p + 36;
+}
+
+/**
+ * Name of the selected kernels: "avx2", "sse2" or "scalar".
+ */
+const char * r3_scan_kernels(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_SCAN_H */
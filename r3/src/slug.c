@@ -19,6 +19,11 @@ r3_slug_t * r3_slug_new(const char * path, int path_len) {
     r3_slug_t * s = malloc(sizeof(r3_slug_t));
     if (!s)
         return NULL;
+    r3_slug_init(s, path, path_len);
+    return s;
+}
+
+void r3_slug_init(r3_slug_t * s, const char * path, int path_len) {
     s->path = (char*) path;
     s->path_len = path_len;
 
@@ -28,7 +33,6 @@ r3_slug_t * r3_slug_new(const char * path, int path_len) {
 
     s->pattern = NULL;
     s->pattern_len = 0;
-    return s;
 }
 
 void r3_slug_free(r3_slug_t * s) {
@@ -41,6 +41,11 @@ typedef struct {
 
 r3_slug_t * r3_slug_new(const char * path, int path_len);
 
+/**
+ * Same as r3_slug_new for a slug on the stack.
+ */
+void r3_slug_init(r3_slug_t * s, const char * path, int path_len);
+
 int r3_slug_check(r3_slug_t *s);
 
 int r3_slug_parse(r3_slug_t *s, const char *needle, int needle_len, const char *offset, char **errstr);
@@ -51,34 +51,133 @@ char *strndup(const char *s, long long unsigned int n) {
 }
 #endif
 
-int r3_pattern_to_opcode(const char * pattern, unsigned int len) {
-    if ( strncmp(pattern, "\\w+",len) == 0 ) {
-        return OP_EXPECT_MORE_WORDS;
+/**
+ * Character classes which can be spanned by an opcode.
+ */
+static const struct {
+    const char * atom;
+    int opcode;
+} r3_opcode_atoms[] = {
+    { "\\d",            OP_EXPECT_MORE_DIGITS },
+    { "[0-9]",          OP_EXPECT_MORE_DIGITS },
+    { "\\w",            OP_EXPECT_MORE_WORDS },
+    { "[0-9a-z]",       OP_EXPECT_MORE_WORDS },
+    { "[a-z0-9]",       OP_EXPECT_MORE_WORDS },
+    { "[a-z]",          OP_EXPECT_MORE_ALPHA },
+    { "[^/]",           OP_EXPECT_NOSLASH },
+    { "[^-]",           OP_EXPECT_NODASH },
+    { ".",              OP_GREEDY_ANY },
+    { "[0-9a-f]",       OP_EXPECT_HEX },
+    { "[a-f0-9]",       OP_EXPECT_HEX },
+    { "[0-9a-fA-F]",    OP_EXPECT_XDIGIT },
+    { "[0-9A-Fa-f]",    OP_EXPECT_XDIGIT },
+    { "[a-fA-F0-9]",    OP_EXPECT_XDIGIT },
+    { "[A-Fa-f0-9]",    OP_EXPECT_XDIGIT },
+    { "[A-Za-z0-9_-]",  OP_EXPECT_IDENT },
+    { "[a-zA-Z0-9_-]",  OP_EXPECT_IDENT },
+    { "[\\w-]",         OP_EXPECT_IDENT },
+    { NULL, 0 }
+};
+
+/**
+ * Parse the quantifier of an atom: + * {n} {n,} or {n,m}. Returns 0 if
+ * the pattern has anything else.
+ */
+static int r3_parse_quantifier(const char * p, const char * end, unsigned int * min, unsigned int * max) {
+    unsigned int n = 0, m = 0;
+    int has_m = 0;
+
+    if (end - p == 1 && (*p == '+' || *p == '*')) {
+        *min = *p == '+';
+        *max = 0;
+        return 1;
     }
-    if ( strncmp(pattern, "[0-9a-z]+",len) == 0 ||  strncmp(pattern, "[a-z0-9]+",len) == 0  ) {
-        return OP_EXPECT_MORE_WORDS;
+
+    if (p == end || *p++ != '{' || p == end || *p < '0' || *p > '9') {
+        return 0;
     }
-    if ( strncmp(pattern, "[a-z]+",len) == 0 ) {
-        return OP_EXPECT_MORE_ALPHA;
+    while (p < end && *p >= '0' && *p <= '9' && n <= R3_OPCODE_MAX_REPEAT) {
+        n = n * 10 + (*p++ - '0');
     }
-    if ( strncmp(pattern, "\\d+", len) == 0 ) {
-        return OP_EXPECT_MORE_DIGITS;
+
+    if (p < end && *p == ',') {
+        for (p++; p < end && *p >= '0' && *p <= '9' && m <= R3_OPCODE_MAX_REPEAT; p++) {
+            m = m * 10 + (*p - '0');
+            has_m = 1;
+        }
+    } else {
+        m = n;
+        has_m = 1;
     }
-    if ( strncmp(pattern, "[0-9]+", len) == 0 ) {
-        return OP_EXPECT_MORE_DIGITS;
+
+    if (p + 1 != end || *p != '}' || n > R3_OPCODE_MAX_REPEAT || m > R3_OPCODE_MAX_REPEAT) {
+        return 0;
     }
-    if ( strncmp(pattern, "[^/]+", len) == 0 ) {
-        return OP_EXPECT_NOSLASH;
+    if (has_m && (m < n || m == 0)) {
+        return 0;
     }
-    if ( strncmp(pattern, "[^-]+", len) == 0 ) {
-        return OP_EXPECT_NODASH;
+
+    *min = n;
+    *max = has_m ? m : 0;
+    return 1;
+}
+
+/**
+ * Recognize the UUID pattern H{8}-H{4}-H{4}-H{4}-H{12} for a class of
+ * hex digits H.
+ */
+static int r3_pattern_to_uuid(const char * pattern, unsigned int len) {
+    char buf[128];
+    unsigned int i;
+
+    for (i = 0; r3_opcode_atoms[i].atom; i++) {
+        const char * a = r3_opcode_atoms[i].atom;
+        int opcode = r3_opcode_atoms[i].opcode;
+
+        if (opcode != OP_EXPECT_HEX && opcode != OP_EXPECT_XDIGIT) {
+            continue;
+        }
+
+        snprintf(buf, sizeof(buf), "%s{8}-%s{4}-%s{4}-%s{4}-%s{12}", a, a, a, a, a);
+
+        if (strlen(buf) == len && !strncmp(buf, pattern, len)) {
+            return opcode == OP_EXPECT_HEX ? OP_EXPECT_UUID : OP_EXPECT_XUUID;
+        }
     }
-    if ( strncmp(pattern, ".*", len) == 0 ) {
-        return OP_GREEDY_ANY;
+    return 0;
+}
+
+int r3_pattern_to_opcode_ex(const char * pattern, unsigned int len, unsigned int * min, unsigned int * max) {
+    unsigned int i;
+    int opcode;
+
+    if ((opcode = r3_pattern_to_uuid(pattern, len))) {
+        *min = *max = 36;
+        return opcode;
+    }
+
+    for (i = 0; r3_opcode_atoms[i].atom; i++) {
+        unsigned int atom_len = strlen(r3_opcode_atoms[i].atom);
+
+        if (atom_len >= len || strncmp(pattern, r3_opcode_atoms[i].atom, atom_len) ||
+            !r3_parse_quantifier(pattern + atom_len, pattern + len, min, max)) {
+            continue;
+        }
+
+        // empty regex slugs do not match, only the catch-all .* may be empty
+        if (!*min && (r3_opcode_atoms[i].opcode != OP_GREEDY_ANY || *max)) {
+            return 0;
+        }
+        return r3_opcode_atoms[i].opcode;
     }
     return 0;
 }
 
+int r3_pattern_to_opcode(const char * pattern, unsigned int len) {
+    unsigned int min, max;
+    return r3_pattern_to_opcode_ex(pattern, len, &min, &max);
+}
+
 char * r3_inside_slug(const char * needle, int needle_len, char *offset, char **errstr) {
     char * s1 = offset;
     char * s2 = offset;
@@ -202,13 +301,14 @@ const char * r3_slug_find_name(const char *s1, unsigned int str_len, unsigned in
 
 
 /**
- * @param char * sep separator
+ * Compile the first slug of the pattern into a capture group, for example
+ * "foo/{id:\d+}" into "^foo/(\d+)". The result is allocated to fit.
  */
 char * r3_slug_compile(const char * str, unsigned int len)
 {
     const char *s1 = NULL;
-    char *o = NULL;
     const char *pat = NULL;
+    char *o = NULL;
     char sep = '/';
 
 
@@ -220,35 +320,37 @@ char * r3_slug_compile(const char * str, unsigned int len)
         return strndup(str,len);
     }
 
+    unsigned int pat_len;
+    pat = r3_slug_find_pattern(s1, s1_len, &pat_len);
+
+    unsigned int prefix_len = s1 - str;
+    unsigned int suffix_len = len - prefix_len - s1_len;
+    unsigned int group_len = pat ? pat_len + 2 : strlen("([^*]+)");
+
     char * out = NULL;
-    if (!(out = calloc(1, sizeof(char) * 200))) {
+    if (!(out = malloc(1 + prefix_len + group_len + suffix_len + 1))) {
         return (NULL);
     }
 
     o = out;
-    strncat(o, "^", 1);
-    o++;
+    *o++ = '^';
 
-    strncat(o, str, s1 - str); // string before slug
-    o += (s1 - str);
-
-
-    unsigned int pat_len;
-    pat = r3_slug_find_pattern(s1, s1_len, &pat_len);
+    memcpy(o, str, prefix_len); // string before slug
+    o += prefix_len;
 
     if (pat) {
-        *o = '(';
-        o++;
-        strncat(o, pat, pat_len );
+        *o++ = '(';
+        memcpy(o, pat, pat_len);
         o += pat_len;
-        *o = ')';
-        o++;
+        *o++ = ')';
     } else {
         sprintf(o, "([^%c]+)", sep);
-        o+= strlen("([^*]+)");
+        o += group_len;
     }
-    s1 += s1_len;
-    strncat(o, s1, len - (s1 - str)); // string after slug
+
+    memcpy(o, s1 + s1_len, suffix_len); // string after slug
+    o += suffix_len;
+    *o = '\0';
     return out;
 }
 
@@ -0,0 +1,124 @@
+/*
+ * vhost.c
+ *
+ * Distributed under terms of the MIT license.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "r3.h"
+#include "cidr.h"
+#include "vhost.h"
+
+/**
+ * Suffix of a route host which has to match, without the leading '*'.
+ */
+static inline r3_iovec_t r3_route_host_suffix(const R3Route * route) {
+    if (route->host.len && route->host.base[0] == '*') {
+        return r3_iovec_init(route->host.base + 1, route->host.len - 1);
+    }
+    return route->host;
+}
+
+static uint32_t r3_vhost_child(const R3VhostNode * nodes, uint32_t node, unsigned char c) {
+    uint32_t child;
+
+    for (child = nodes[node].child; child && nodes[child].c != c; child = nodes[child].sibling);
+    return child;
+}
+
+R3Vhost * r3_vhost_create(const R3Node * n) {
+    R3_VECTOR(R3VhostNode) nodes = { NULL, 0, 0 };
+    unsigned int indexed = 0;
+    uint32_t i, j, node, child;
+    R3Vhost * vhost;
+
+    for (i = 0; i < n->routes.size; i++) {
+        indexed += n->routes.entries[i].host.len > 0;
+    }
+    if (indexed < R3_VHOST_MIN) {
+        return NULL;
+    }
+
+    vhost = r3_mem_alloc(sizeof(R3Vhost));
+    vhost->next = r3_mem_alloc(sizeof(uint32_t) * n->routes.size);
+    vhost->others = r3_mem_alloc(sizeof(uint32_t) * n->routes.size);
+    vhost->others_len = 0;
+    vhost->routes_len = n->routes.size;
+
+    r3_vector_reserve(&nodes, 1);
+    memset(nodes.entries, 0, sizeof(R3VhostNode));
+    nodes.size = 1;
+
+    // the routes are chained in reverse, so that each chain is in order
+    for (i = n->routes.size; i-- > 0;) {
+        const R3Route * route = n->routes.entries + i;
+        r3_iovec_t suffix = r3_route_host_suffix(route);
+
+        vhost->next[i] = 0;
+
+        if (!route->host.len) {
+            continue;
+        }
+
+        for (node = 0, j = suffix.len; j-- > 0;) {
+            unsigned char c = suffix.base[j];
+
+            if (!(child = r3_vhost_child(nodes.entries, node, c))) {
+                r3_vector_reserve(&nodes, nodes.size + 1);
+                child = nodes.size++;
+                nodes.entries[child].child   = 0;
+                nodes.entries[child].sibling = nodes.entries[node].child;
+                nodes.entries[child].routes  = 0;
+                nodes.entries[child].c       = c;
+                nodes.entries[node].child    = child;
+            }
+            node = child;
+        }
+
+        vhost->next[i] = nodes.entries[node].routes;
+        nodes.entries[node].routes = i + 1;
+    }
+
+    for (i = 0; i < n->routes.size; i++) {
+        if (!n->routes.entries[i].host.len) {
+            vhost->others[vhost->others_len++] = i;
+        }
+    }
+
+    vhost->nodes = nodes.entries;
+    vhost->nodes_len = nodes.size;
+    return vhost;
+}
+
+void r3_vhost_free(R3Vhost * vhost) {
+    if (!vhost) {
+        return;
+    }
+    free(vhost->nodes);
+    free(vhost->next);
+    free(vhost->others);
+    free(vhost);
+}
+
+R3Route * r3_vhost_match_route(const R3Vhost * vhost, const R3Node * n, match_entry * entry) {
+    uint32_t * hits = match_entry_scratch(entry, sizeof(uint32_t) * (vhost->routes_len + 1));
+    const char * host = entry->host.base;
+    uint32_t hits_len = 0, node = 0, r;
+    unsigned int i = entry->host.len;
+
+    // collect the routes of all suffixes of the host, from the shortest one
+    for (;;) {
+        for (r = vhost->nodes[node].routes; r; r = vhost->next[r - 1]) {
+            // a wildcard needs at least one byte in front of its suffix
+            if (n->routes.entries[r - 1].host.len <= entry->host.len) {
+                r3_routes_add_hit(hits, &hits_len, r - 1);
+            }
+        }
+        if (!i || !(node = r3_vhost_child(vhost->nodes, node, host[--i]))) {
+            break;
+        }
+    }
+    return r3_routes_match_merged(n, hits, hits_len, vhost->others, vhost->others_len, entry);
+}
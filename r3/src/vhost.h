@@ -0,0 +1,65 @@
+/*
+ * vhost.h
+ *
+ * Distributed under terms of the MIT license.
+ */
+#ifndef R3_VHOST_H
+#define R3_VHOST_H
+
+#include <stdint.h>
+#include "r3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// endpoints with at least this many host routes get a suffix trie
+#ifndef R3_VHOST_MIN
+#define R3_VHOST_MIN 8
+#endif
+
+typedef struct _vhost_node {
+    uint32_t child;          // first child, 0 for none
+    uint32_t sibling;        // next child of the same parent, 0 for none
+    uint32_t routes;         // first route + 1 whose host ends here, or 0
+    unsigned char c;
+} R3VhostNode;
+
+/**
+ * Trie over the reversed hosts of the routes of one endpoint. A route host
+ * matches the request host if it is a suffix of it, a leading '*' stands
+ * for at least one more byte. So example.com and *.example.com both end in
+ * the trie node of example.com, routes of the same suffix are chained in
+ * their order and routes without a host are kept aside.
+ */
+struct _vhost {
+    R3VhostNode * nodes;     // the root first
+    uint32_t nodes_len;
+    uint32_t * next;         // next route + 1 with the same suffix, per route
+
+    uint32_t * others;       // routes without a host, in order
+    uint32_t others_len;
+
+    uint32_t routes_len;     // routes of the endpoint at compile time
+};
+
+/**
+ * Index the host routes of an endpoint. Returns NULL if it has less than
+ * R3_VHOST_MIN of them.
+ */
+R3Vhost * r3_vhost_create(const R3Node * n);
+
+void r3_vhost_free(R3Vhost * vhost);
+
+/**
+ * Same as the loop over the routes in r3_tree_match_route, but only the
+ * routes whose host is a suffix of the host of the entry are compared.
+ * The entry must have a host.
+ */
+R3Route * r3_vhost_match_route(const R3Vhost * vhost, const R3Node * n, match_entry * entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !R3_VHOST_H */
@@ -31,21 +31,209 @@
 #include "mruby/error.h"
 #include "memory.h"
 #include "r3.h"
+#include "cidr.h"
+#include "cache.h"
+#include "flat.h"
+#include "arena.h"
+#include "pool.h"
 #include <stdio.h>
 
 #ifdef _MSC_VER
 # define strdup _strdup
 #endif
 
+#ifdef _WIN32
+# include <windows.h>
+# define mrb_r3_atomic_inc(p) InterlockedIncrement(p)
+# define mrb_r3_atomic_dec(p) InterlockedDecrement(p)
+# define mrb_r3_atomic_get(p) InterlockedCompareExchange(p, 0, 0)
+# define mrb_r3_lock(l)       while (InterlockedExchange(l, 1)) Sleep(0)
+# define mrb_r3_unlock(l)     InterlockedExchange(l, 0)
+# define mrb_r3_thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+typedef HANDLE mrb_r3_thread;
+#else
+# include <sched.h>
+# include <pthread.h>
+# define mrb_r3_atomic_inc(p) __sync_add_and_fetch(p, 1)
+# define mrb_r3_atomic_dec(p) __sync_sub_and_fetch(p, 1)
+# define mrb_r3_atomic_get(p) __sync_fetch_and_add(p, 0)
+# define mrb_r3_lock(l)       while (__sync_lock_test_and_set(l, 1)) sched_yield()
+# define mrb_r3_unlock(l)     __sync_lock_release(l)
+# define mrb_r3_thread_join(t) pthread_join(t, NULL)
+typedef pthread_t mrb_r3_thread;
+#endif
+
+/**
+ * A compiled tree published under a name. The tree and all the strings it
+ * points to are owned by the process, not by any mrb_state, so every VM can
+ * match against it. Route data is bound per VM through the route id which is
+ * stored as the data pointer of each route.
+ */
+typedef struct mrb_r3_shared {
+    char *name;
+    R3Node *tree;
+    R3Route **routes;
+    unsigned int routes_size;
+    volatile long refs;
+    struct mrb_r3_shared *next;
+} mrb_r3_shared;
+
+static mrb_r3_shared *mrb_r3_shared_list = NULL;
+static volatile long mrb_r3_shared_lock  = 0;
+
 static void
 mrb_r3_tree_free(mrb_state *mrb, void *p)
 {
+    (void)mrb;
+
     if (!p) { return; }
 
     r3_tree_free((R3Node*)p);
 }
 
-static mrb_data_type const mrb_r3_tree_type = { "R3::Tree", mrb_r3_tree_free };
+static void
+mrb_r3_shared_release(mrb_r3_shared *shared)
+{
+    if (mrb_r3_atomic_dec(&shared->refs) > 0)
+        return;
+
+    r3_tree_free(shared->tree);
+    free(shared->routes);
+    free(shared->name);
+    free(shared);
+}
+
+static void
+mrb_r3_shared_free(mrb_state *mrb, void *p)
+{
+    (void)mrb;
+
+    if (!p) { return; }
+
+    mrb_r3_shared_release((mrb_r3_shared*)p);
+}
+
+/**
+ * State of a tree object which is not shared with other mrb_states: the
+ * optional cache of match results and the counters of the filter.
+ */
+typedef struct mrb_r3_local {
+    R3Cache *cache;
+    mrb_int lookups;
+    mrb_int rejects;
+} mrb_r3_local;
+
+static void
+mrb_r3_local_free(mrb_state *mrb, void *p)
+{
+    mrb_r3_local *local = p;
+
+    if (!local) { return; }
+
+    r3_cache_free(local->cache);
+    mrb_free(mrb, local);
+}
+
+/**
+ * A tree which is compiled by a native thread. The build owns the tree
+ * until the thread has been joined, the tree object points to NULL in the
+ * meantime.
+ */
+typedef struct mrb_r3_build {
+    R3Node *tree;
+    int flags;
+    int ret;
+    char *err;
+    mrb_r3_thread thread;
+    volatile long done;
+} mrb_r3_build;
+
+static void
+mrb_r3_build_free(mrb_state *mrb, void *p)
+{
+    mrb_r3_build *build = p;
+
+    if (!build) { return; }
+
+    mrb_r3_thread_join(build->thread);
+
+    if (build->tree) r3_tree_free(build->tree);
+    free(build->err);
+    mrb_free(mrb, build);
+}
+
+static mrb_data_type const mrb_r3_tree_type   = { "R3::Tree", mrb_r3_tree_free };
+static mrb_data_type const mrb_r3_shared_type = { "R3::SharedTree", mrb_r3_shared_free };
+static mrb_data_type const mrb_r3_local_type  = { "R3::Local", mrb_r3_local_free };
+static mrb_data_type const mrb_r3_build_type  = { "R3::Build", mrb_r3_build_free };
+
+/**
+ * Raise the error message which libr3 allocated and free it.
+ */
+static void
+mrb_r3_raise_err(mrb_state *mrb, struct RClass *cls, char *err)
+{
+    mrb_value msg = mrb_str_new_cstr(mrb, err ? err : "Unknown error.");
+
+    free(err);
+    mrb_exc_raise(mrb, mrb_exc_new_str(mrb, cls, msg));
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+mrb_r3_build_run(LPVOID p)
+#else
+static void *
+mrb_r3_build_run(void *p)
+#endif
+{
+    mrb_r3_build *build = p;
+
+    build->ret = r3_tree_compile_ex(build->tree, build->flags, &build->err);
+    mrb_r3_atomic_inc(&build->done);
+
+    return 0;
+}
+
+/**
+ * Wait for the background compile of the tree, if any, and hand the tree
+ * back to the object. Raises if the compile failed.
+ */
+static void
+mrb_r3_join(mrb_state *mrb, mrb_value self)
+{
+    mrb_sym attr = mrb_intern_lit(mrb, "@build");
+    mrb_value obj = mrb_iv_get(mrb, self, attr);
+    mrb_r3_build *build;
+    char *err;
+
+    if (mrb_nil_p(obj))
+        return;
+
+    build = DATA_PTR(obj);
+    mrb_r3_thread_join(build->thread);
+
+    DATA_PTR(self) = build->tree;
+    err            = build->err;
+
+    DATA_PTR(obj) = NULL;
+    mrb_free(mrb, build);
+    mrb_iv_remove(mrb, self, attr);
+
+    if (err)
+        mrb_r3_raise_err(mrb, E_RUNTIME_ERROR, err);
+}
+
+static inline R3Node *
+mrb_r3_tree_ptr(mrb_state *mrb, mrb_value self)
+{
+    if (DATA_TYPE(self) == &mrb_r3_shared_type)
+        return ((mrb_r3_shared *)DATA_PTR(self))->tree;
+
+    mrb_r3_join(mrb, self);
+
+    return DATA_PTR(self);
+}
 
 static inline void
 mrb_r3_chomp_path(char *path, mrb_int *len)
@@ -57,6 +245,69 @@ mrb_r3_chomp_path(char *path, mrb_int *len)
     path[*len] = '\0';
 }
 
+/**
+ * The local state of the tree object or NULL, it is kept in an instance
+ * variable without @, which is hidden from Ruby.
+ */
+static inline mrb_r3_local *
+mrb_r3_local_ptr(mrb_state *mrb, mrb_value self)
+{
+    mrb_value obj = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "local"));
+
+    return mrb_nil_p(obj) ? NULL : DATA_PTR(obj);
+}
+
+/**
+ * Set up the local state of the tree object, which is done once when the
+ * object is created.
+ */
+static mrb_r3_local *
+mrb_r3_local_init(mrb_state *mrb, mrb_value self)
+{
+    mrb_r3_local *local = mrb_r3_local_ptr(mrb, self);
+    mrb_value obj;
+
+    if (local)
+        return local;
+
+    local = mrb_malloc(mrb, sizeof(mrb_r3_local));
+    memset(local, 0, sizeof(mrb_r3_local));
+
+    obj = mrb_obj_value(mrb_data_object_alloc(mrb, mrb->object_class, local, &mrb_r3_local_type));
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "local"), obj);
+
+    return local;
+}
+
+static inline void
+mrb_r3_cache_clear(mrb_state *mrb, mrb_value self)
+{
+    mrb_r3_local *local = mrb_r3_local_ptr(mrb, self);
+
+    if (local && local->cache) r3_cache_clear(local->cache);
+}
+
+static inline R3Route *
+mrb_r3_match_route(mrb_state *mrb, mrb_value self, R3Node *tree, match_entry *entry)
+{
+    mrb_r3_local *local = mrb_r3_local_ptr(mrb, self);
+    R3Route *route;
+
+    if (!local)
+        return r3_tree_match_route(tree, entry);
+
+    if (local->cache) {
+        route = r3_cache_match_route(local->cache, tree, entry);
+    } else {
+        route = r3_tree_match_route(tree, entry);
+    }
+
+    local->lookups++;
+    local->rejects += entry->rejected ? 1 : 0;
+
+    return route;
+}
+
 static inline mrb_value
 mrb_r3_data_ary(mrb_state *mrb, mrb_value self)
 {
@@ -73,20 +324,144 @@ mrb_r3_save_data(mrb_state *mrb, mrb_value self, mrb_value data)
     return RARRAY_LEN(ary);
 }
 
+/**
+ * Keyword arguments for the host, scheme and remote address of a route or
+ * a request. Missing ones are left undefined.
+ */
+enum { MRB_R3_HOST, MRB_R3_SCHEME, MRB_R3_ADDR, MRB_R3_CONDS };
+
+static inline void
+mrb_r3_conds_init(mrb_state *mrb, mrb_kwargs *kw, mrb_sym *names, mrb_value *conds)
+{
+    names[MRB_R3_HOST]   = mrb_intern_lit(mrb, "host");
+    names[MRB_R3_SCHEME] = mrb_intern_lit(mrb, "scheme");
+    names[MRB_R3_ADDR]   = mrb_intern_lit(mrb, "remote_addr");
+
+    kw->num      = MRB_R3_CONDS;
+    kw->required = 0;
+    kw->table    = names;
+    kw->values   = conds;
+    kw->rest     = NULL;
+}
+
+static inline mrb_bool
+mrb_r3_cond_str(mrb_state *mrb, mrb_value cond)
+{
+    if (mrb_undef_p(cond) || mrb_nil_p(cond))
+        return FALSE;
+
+    if (!mrb_string_p(cond))
+        mrb_raise(mrb, E_TYPE_ERROR, "Host and remote address must be strings.");
+
+    return TRUE;
+}
+
+static inline mrb_bool
+mrb_r3_cond_int(mrb_state *mrb, mrb_value cond)
+{
+    if (mrb_undef_p(cond) || mrb_nil_p(cond))
+        return FALSE;
+
+    if (!mrb_fixnum_p(cond))
+        mrb_raise(mrb, E_TYPE_ERROR, "Scheme must be an integer.");
+
+    return TRUE;
+}
+
+/**
+ * Raise for a condition of the wrong type, before anything is allocated for
+ * the request, see mrb_r3_entry_conds.
+ */
+static inline void
+mrb_r3_check_conds(mrb_state *mrb, mrb_value *conds)
+{
+    mrb_r3_cond_str(mrb, conds[MRB_R3_HOST]);
+    mrb_r3_cond_int(mrb, conds[MRB_R3_SCHEME]);
+    mrb_r3_cond_str(mrb, conds[MRB_R3_ADDR]);
+}
+
 static void
-mrb_r3_save_route(mrb_state *mrb, mrb_value self, mrb_int method, const char *route, int len)
+mrb_r3_entry_conds(mrb_state *mrb, match_entry *entry, mrb_value *conds)
+{
+    if (mrb_r3_cond_str(mrb, conds[MRB_R3_HOST]))
+        entry->host = r3_iovec_init(RSTRING_PTR(conds[MRB_R3_HOST]), RSTRING_LEN(conds[MRB_R3_HOST]));
+
+    if (mrb_r3_cond_int(mrb, conds[MRB_R3_SCHEME]))
+        entry->http_scheme = (int)mrb_fixnum(conds[MRB_R3_SCHEME]);
+
+    if (mrb_r3_cond_str(mrb, conds[MRB_R3_ADDR]))
+        entry->remote_addr = r3_iovec_init(RSTRING_PTR(conds[MRB_R3_ADDR]), RSTRING_LEN(conds[MRB_R3_ADDR]));
+}
+
+/**
+ * Restrict the route to an address like 10.0.0.1 or a network like
+ * 10.0.0.0/8 or 2001:db8::/32.
+ */
+static void
+mrb_r3_route_addr(mrb_state *mrb, R3Route *route, const char *addr, mrb_int len)
+{
+    const char *mask = memchr(addr, '/', len);
+    mrb_int addr_len = mask ? mask - addr : len;
+    int family, bits = 0, i;
+    uint32_t ip[4];
+
+    family = r3_addr_parse(addr, (unsigned int)addr_len, ip);
+
+    if (family == R3_ADDR_INVALID)
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Invalid remote address.");
+
+    if (!mask) {
+        bits = family == R3_ADDR_V4 ? 32 : 128;
+    } else if (len - addr_len < 2 || len - addr_len > 4) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Invalid remote address.");
+    }
+
+    for (i = (int)addr_len + 1; mask && i < len; i++) {
+        if (addr[i] < '0' || addr[i] > '9')
+            mrb_raise(mrb, E_ARGUMENT_ERROR, "Invalid remote address.");
+
+        bits = bits * 10 + (addr[i] - '0');
+    }
+
+    if (bits > (family == R3_ADDR_V4 ? 32 : 128))
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Invalid remote address.");
+
+    if (family == R3_ADDR_V4) {
+        route->remote_addr_v4      = ip[0];
+        route->remote_addr_v4_bits = bits;
+        return;
+    }
+
+    for (i = 0; i < 4; i++, bits -= 32) {
+        route->remote_addr_v6[i]      = ip[i];
+        route->remote_addr_v6_bits[i] = bits < 0 ? 0 : (bits > 32 ? 32 : bits);
+    }
+}
+
+static void
+mrb_r3_route_conds(mrb_state *mrb, R3Node *tree, R3Route *route, mrb_value *conds)
+{
+    mrb_value host = conds[MRB_R3_HOST];
+
+    if (mrb_r3_cond_str(mrb, host))
+        route->host = r3_iovec_init(r3_tree_intern(tree, RSTRING_PTR(host), RSTRING_LEN(host)), RSTRING_LEN(host));
+
+    if (mrb_r3_cond_int(mrb, conds[MRB_R3_SCHEME]))
+        route->http_scheme = (int)mrb_fixnum(conds[MRB_R3_SCHEME]);
+
+    if (mrb_r3_cond_str(mrb, conds[MRB_R3_ADDR]))
+        mrb_r3_route_addr(mrb, route, RSTRING_PTR(conds[MRB_R3_ADDR]), RSTRING_LEN(conds[MRB_R3_ADDR]));
+}
+
+static mrb_value
+mrb_r3_route_name(mrb_state *mrb, mrb_int method, const char *route, int len)
 {
-    mrb_sym attr;
-    mrb_value ary, data;
 #ifdef _MSC_VER
     char buf[256];
 #else
-    char buf[len + 8];
+    char buf[len + 9];
 #endif
 
-    attr = mrb_intern_lit(mrb, "@routes");
-    ary  = mrb_iv_get(mrb, self, attr);
-
     switch (method) {
         case METHOD_GET:
             sprintf(buf, "GET %s", route);
@@ -114,15 +489,14 @@ mrb_r3_save_route(mrb_state *mrb, mrb_value self, mrb_int method, const char *ro
             break;
     }
 
-    data = mrb_str_new_cstr(mrb, buf);
-    mrb_ary_push(mrb, ary, data);
+    return mrb_str_new_cstr(mrb, buf);
 }
 
 static mrb_value
 mrb_r3_f_init(mrb_state *mrb, mrb_value self)
 {
     mrb_int capa = 5;
-    mrb_sym data, routes;
+    mrb_sym data;
 
     mrb_get_args(mrb, "|i", &capa);
 
@@ -132,10 +506,8 @@ mrb_r3_f_init(mrb_state *mrb, mrb_value self)
     data = mrb_intern_lit(mrb, "@data");
     mrb_iv_set(mrb, self, data, mrb_ary_new_capa(mrb, capa));
 
-    routes = mrb_intern_lit(mrb, "@routes");
-    mrb_iv_set(mrb, self, routes, mrb_ary_new_capa(mrb, capa));
-
     mrb_data_init(self, r3_tree_create((int)capa), &mrb_r3_tree_type);
+    mrb_r3_local_init(mrb, self);
 
     return self;
 }
@@ -145,42 +517,168 @@ mrb_r3_f_add(mrb_state *mrb, mrb_value self)
 {
     mrb_int path_len, method = 0;
     const char *path;
-    R3Node *tree = DATA_PTR(self);
+    R3Node *tree = mrb_r3_tree_ptr(mrb, self);
     mrb_value data = mrb_nil_value();
     mrb_bool data_given;
-    mrb_value path_str;
+    mrb_value conds[MRB_R3_CONDS];
+    mrb_sym names[MRB_R3_CONDS];
+    mrb_kwargs kw;
+    R3Route *route;
+    char *err = NULL;
 
-    mrb_get_args(mrb, "s|io?", &path, &path_len, &method, &data, &data_given);
+    mrb_r3_conds_init(mrb, &kw, names, conds);
+    mrb_get_args(mrb, "s|io?:", &path, &path_len, &method, &data, &data_given, &kw);
 
-    path_str = mrb_str_new(mrb, path, path_len);
-    path     = mrb_string_value_ptr(mrb, path_str);
-    mrb_r3_chomp_path((char *)path, &path_len);
+    // the tree keeps a copy of the path in its string pool
+    if (path_len > 1 && path[path_len - 1] == '/')
+        path_len -= 1;
 
     if (data_given) {
-        r3_tree_insert_routel(tree, (int)method, path, (int)path_len, (void*)mrb_r3_save_data(mrb, self, data));
+        route = r3_tree_insert_routel_ex(tree, (int)method, path, (int)path_len, (void*)mrb_r3_save_data(mrb, self, data), &err);
     } else {
-        r3_tree_insert_routel(tree, (int)method, path, (int)path_len, NULL);
+        route = r3_tree_insert_routel_ex(tree, (int)method, path, (int)path_len, NULL, &err);
     }
 
-    mrb_r3_save_data(mrb, self, path_str);
-    mrb_r3_save_route(mrb, self, method, path, (int)path_len);
+    if (!route) {
+        if (data_given) mrb_ary_pop(mrb, mrb_r3_data_ary(mrb, self));
+        mrb_r3_raise_err(mrb, E_ARGUMENT_ERROR, err);
+    }
+
+    mrb_r3_route_conds(mrb, tree, route, conds);
+    mrb_r3_cache_clear(mrb, self);
 
     return mrb_nil_value();
 }
 
+typedef struct {
+    mrb_state *mrb;
+    mrb_value data;
+    int method;
+    const char *path;
+    mrb_int path_len;
+} mrb_r3_route_ref;
+
+static void
+mrb_r3_release_route(R3Route *route, void *udata)
+{
+    mrb_r3_route_ref *ref = udata;
+
+    if (!route->data || route->request_method != ref->method || route->path.len != ref->path_len)
+        return;
+
+    if (memcmp(route->path.base, ref->path, ref->path_len) == 0)
+        mrb_ary_set(ref->mrb, ref->data, (mrb_int)route->data - 1, mrb_nil_value());
+}
+
 static mrb_value
-mrb_r3_f_compile(mrb_state *mrb, mrb_value self)
+mrb_r3_f_delete(mrb_state *mrb, mrb_value self)
 {
+    mrb_int path_len, method = 0;
+    const char *path;
+    char *err = NULL;
     int ret;
+    R3Node *tree;
+    mrb_r3_route_ref ref;
+
+    mrb_get_args(mrb, "s|i", &path, &path_len, &method);
+
+    if (DATA_TYPE(self) == &mrb_r3_shared_type)
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Routes can not be deleted from a shared tree.");
+
+    tree = mrb_r3_tree_ptr(mrb, self);
+
+    if (!tree)
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Tree has been freed.");
+
+    if (path_len > 1 && path[path_len - 1] == '/')
+        path_len -= 1;
+
+    ref.mrb      = mrb;
+    ref.data     = mrb_r3_data_ary(mrb, self);
+    ref.method   = (int)method;
+    ref.path     = path;
+    ref.path_len = path_len;
+    r3_tree_each_route(tree, mrb_r3_release_route, &ref);
+
+    mrb_r3_cache_clear(mrb, self);
+    ret = r3_tree_delete_routel_ex(tree, (int)method, path, (int)path_len, &err);
+
+    if (err)
+        mrb_r3_raise_err(mrb, E_RUNTIME_ERROR, err);
+
+    return mrb_bool_value(ret > 0);
+}
+
+/**
+ * Hand the tree over to a native thread which compiles it. Returns FALSE
+ * if no thread could be started.
+ */
+static mrb_bool
+mrb_r3_compile_background(mrb_state *mrb, mrb_value self, R3Node *tree, int flags)
+{
+    mrb_r3_build *build = mrb_malloc(mrb, sizeof(mrb_r3_build));
+    mrb_value obj;
+    mrb_bool started;
+
+    memset(build, 0, sizeof(mrb_r3_build));
+    build->tree  = tree;
+    build->flags = flags;
+
+#ifdef _WIN32
+    build->thread = CreateThread(NULL, 0, mrb_r3_build_run, build, 0, NULL);
+    started       = build->thread != NULL;
+#else
+    started = pthread_create(&build->thread, NULL, mrb_r3_build_run, build) == 0;
+#endif
+
+    if (!started) {
+        mrb_free(mrb, build);
+        return FALSE;
+    }
+
+    obj = mrb_obj_value(mrb_data_object_alloc(mrb, mrb->object_class, build, &mrb_r3_build_type));
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@build"), obj);
+    DATA_PTR(self) = NULL;
+
+    return TRUE;
+}
+
+static mrb_value
+mrb_r3_f_compile(mrb_state *mrb, mrb_value self)
+{
+    int ret, flags = 0;
     char *err = NULL;
-    R3Node *tree = DATA_PTR(self);
+    mrb_value opts = mrb_nil_value();
+    mrb_bool background = FALSE;
+    R3Node *tree = mrb_r3_tree_ptr(mrb, self);
 
-    mrb_get_args(mrb, "");
+    mrb_get_args(mrb, "|o", &opts);
 
-    ret = r3_tree_compile(tree, &err);
+    if (!mrb_nil_p(opts)) {
+        if (!mrb_hash_p(opts))
+            mrb_raise(mrb, E_ARGUMENT_ERROR, "Options must be a hash.");
+
+        if (mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "dfa")))))
+            flags |= R3_COMPILE_DFA;
+
+        if (mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "jit")))))
+            flags |= R3_COMPILE_JIT;
+
+        background = mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "background"))));
+    }
+
+    if (!tree)
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Tree has been freed.");
+
+    mrb_r3_cache_clear(mrb, self);
+
+    if (background && mrb_r3_compile_background(mrb, self, tree, flags))
+        return mrb_nil_value();
+
+    ret = r3_tree_compile_ex(tree, flags, &err);
 
     if (err)
-        mrb_sys_fail(mrb, err);
+        mrb_r3_raise_err(mrb, E_RUNTIME_ERROR, err);
 
     return mrb_fixnum_value(ret);
 }
@@ -190,21 +688,30 @@ mrb_r3_f_matches(mrb_state *mrb, mrb_value self)
 {
     mrb_int path_len, method = 0;
     char *path;
-    R3Node *tree = DATA_PTR(self);
-    match_entry *entry;
+    R3Node *tree = mrb_r3_tree_ptr(mrb, self);
+    match_entry entry;
     R3Route *route;
+    mrb_value conds[MRB_R3_CONDS];
+    mrb_sym names[MRB_R3_CONDS];
+    mrb_kwargs kw;
 
-    mrb_get_args(mrb, "s|i", &path, &path_len, &method);
+    mrb_r3_conds_init(mrb, &kw, names, conds);
+    mrb_get_args(mrb, "s|i:", &path, &path_len, &method, &kw);
+    mrb_r3_check_conds(mrb, conds);
+
+    if (!tree)
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Tree has been freed.");
 
     path = strdup(path);
     mrb_r3_chomp_path(path, &path_len);
 
-    entry = match_entry_createl(path, (int)path_len);
-    entry->request_method = (int)method;
+    match_entry_initl(&entry, path, (int)path_len);
+    entry.request_method = (int)method;
+    mrb_r3_entry_conds(mrb, &entry, conds);
 
-    route = r3_tree_match_route(tree, entry);
+    route = mrb_r3_match_route(mrb, self, tree, &entry);
 
-    match_entry_free(entry);
+    match_entry_release(&entry);
     mrb_free(mrb, path);
 
     return mrb_bool_value(route ? TRUE : FALSE);
@@ -226,23 +733,33 @@ mrb_r3_f_match(mrb_state *mrb, mrb_value self)
     char *path;
     R3Node *tree;
     R3Route *route;
-    match_entry *entry;
+    match_entry entry;
     r3_iovec_t *slugs, *tokens;
     mrb_value params, val, key;
     mrb_value data = mrb_nil_value();
+    mrb_value conds[MRB_R3_CONDS];
+    mrb_sym names[MRB_R3_CONDS];
+    mrb_kwargs kw;
 
-    mrb_get_args(mrb, "s|i", &path, &path_len, &method);
+    mrb_r3_conds_init(mrb, &kw, names, conds);
+    mrb_get_args(mrb, "s|i:", &path, &path_len, &method, &kw);
+    mrb_r3_check_conds(mrb, conds);
+
+    tree = mrb_r3_tree_ptr(mrb, self);
+
+    if (!tree)
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Tree has been freed.");
 
     path = strdup(path);
     mrb_r3_chomp_path(path, &path_len);
 
-    entry                 = match_entry_createl(path, (int)path_len);
-    entry->request_method = (int)method;
-    tree                  = DATA_PTR(self);
-    route                 = r3_tree_match_route(tree, entry);
+    match_entry_initl(&entry, path, (int)path_len);
+    entry.request_method = (int)method;
+    mrb_r3_entry_conds(mrb, &entry, conds);
+    route                = mrb_r3_match_route(mrb, self, tree, &entry);
 
     if (!route) {
-        match_entry_free(entry);
+        match_entry_release(&entry);
         mrb_free(mrb, path);
         return mrb_nil_value();
     }
@@ -253,17 +770,17 @@ mrb_r3_f_match(mrb_state *mrb, mrb_value self)
     }
 
     params = mrb_hash_new(mrb);
-    slugs  = entry->vars.slugs.entries;
-    tokens = entry->vars.tokens.entries;
+    slugs  = entry.vars.slugs.entries;
+    tokens = entry.vars.tokens.entries;
 
-    for (i = 0; i < entry->vars.slugs.size; i++) {
+    for (i = 0; i < entry.vars.slugs.size; i++) {
         key = mrb_str_new_static(mrb, slugs[i].base, slugs[i].len);
         val = mrb_str_new(mrb, tokens[i].base, tokens[i].len);
 
         mrb_hash_set(mrb, params, mrb_str_intern(mrb, key), val);
     }
 
-    match_entry_free(entry);
+    match_entry_release(&entry);
     mrb_free(mrb, path);
 
     if (mrb_nil_p(data))
@@ -276,17 +793,14 @@ static mrb_value
 mrb_r3_f_free(mrb_state *mrb, mrb_value self)
 {
     R3Node *tree;
-    mrb_value routes;
 
-    tree = DATA_PTR(self);
+    tree = mrb_r3_tree_ptr(mrb, self);
 
     if (!tree)
         return mrb_false_value();
 
-    routes = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@routes"));
-    mrb_ary_clear(mrb, routes);
-
     mrb_iv_remove(mrb, self, mrb_intern_lit(mrb, "data"));
+    mrb_r3_cache_clear(mrb, self);
     r3_tree_free(tree);
 
     DATA_PTR(self)  = NULL;
@@ -295,10 +809,473 @@ mrb_r3_f_free(mrb_state *mrb, mrb_value self)
     return mrb_true_value();
 }
 
+typedef struct {
+    R3Route **entries;
+    unsigned int size;
+    unsigned int capacity;
+} mrb_r3_route_list;
+
+static void
+mrb_r3_collect_route(R3Route *route, void *udata)
+{
+    mrb_r3_route_list *list = udata;
+
+    r3_vector_reserve(list, list->size + 1);
+    list->entries[list->size++] = route;
+}
+
+static int
+mrb_r3_route_serial_cmp(const void *a, const void *b)
+{
+    const R3Route *r1 = *(R3Route * const *)a, *r2 = *(R3Route * const *)b;
+
+    return r1->serial < r2->serial ? -1 : r1->serial > r2->serial;
+}
+
+/**
+ * The routes of the tree in the order they were added.
+ */
+static void
+mrb_r3_route_list_init(mrb_r3_route_list *list, const R3Node *tree)
+{
+    list->entries  = NULL;
+    list->size     = 0;
+    list->capacity = 0;
+
+    r3_tree_each_route(tree, mrb_r3_collect_route, list);
+
+    if (list->size)
+        qsort(list->entries, list->size, sizeof(R3Route *), mrb_r3_route_serial_cmp);
+}
+
+static mrb_value
+mrb_r3_f_routes(mrb_state *mrb, mrb_value self)
+{
+    R3Node *tree = mrb_r3_tree_ptr(mrb, self);
+    mrb_r3_route_list list;
+    mrb_value routes;
+    unsigned int i;
+
+    if (!tree)
+        return mrb_ary_new(mrb);
+
+    mrb_r3_route_list_init(&list, tree);
+    routes = mrb_ary_new_capa(mrb, list.size);
+
+    for (i = 0; i < list.size; i++) {
+        R3Route *route = list.entries[i];
+        mrb_ary_push(mrb, routes, mrb_r3_route_name(mrb, route->request_method, route->path.base, route->path.len));
+    }
+
+    free(list.entries);
+
+    return routes;
+}
+
+static void
+mrb_r3_index_route(R3Route *route, void *udata)
+{
+    R3Route **routes = udata;
+
+    routes[(intptr_t)route->data - 1] = route;
+}
+
+static r3_iovec_t
+mrb_r3_intern_iovec(R3Node *tree, r3_iovec_t str)
+{
+    if (!str.len)
+        return r3_iovec_init(NULL, 0);
+
+    return r3_iovec_init(r3_tree_intern(tree, str.base, str.len), str.len);
+}
+
+/**
+ * Rebuild the routes of src into a new tree with a string pool of its own,
+ * so it no longer depends on the mrb_state that created src.
+ */
+static mrb_r3_shared *
+mrb_r3_shared_new(const char *name, const R3Node *src, char **errstr)
+{
+    mrb_r3_route_list list;
+    mrb_r3_shared *shared;
+    unsigned int i;
+
+    mrb_r3_route_list_init(&list, src);
+
+    shared          = r3_mem_alloc(sizeof(mrb_r3_shared));
+    shared->name    = strdup(name);
+    shared->tree    = r3_tree_create(5);
+    shared->routes  = r3_mem_alloc(sizeof(R3Route *) * (list.size + 1));
+    shared->refs    = 1;
+    shared->next    = NULL;
+    shared->routes_size = list.size;
+
+    for (i = 0; i < list.size; i++) {
+        R3Route *orig = list.entries[i];
+        R3Route *route;
+
+        route = r3_tree_insert_routel_ex(shared->tree, orig->request_method, orig->path.base, orig->path.len, (void *)(intptr_t)(i + 1), errstr);
+
+        if (!route) {
+            free(list.entries);
+            mrb_r3_shared_release(shared);
+            return NULL;
+        }
+
+        route->host                = mrb_r3_intern_iovec(shared->tree, orig->host);
+        route->remote_addr_pattern = mrb_r3_intern_iovec(shared->tree, orig->remote_addr_pattern);
+        route->http_scheme         = orig->http_scheme;
+        route->remote_addr_v4      = orig->remote_addr_v4;
+        route->remote_addr_v4_bits = orig->remote_addr_v4_bits;
+        memcpy(route->remote_addr_v6, orig->remote_addr_v6, sizeof(route->remote_addr_v6));
+        memcpy(route->remote_addr_v6_bits, orig->remote_addr_v6_bits, sizeof(route->remote_addr_v6_bits));
+    }
+
+    free(list.entries);
+
+    // compile the copy like the source, with its automaton or jit
+    if (r3_tree_compile_ex(shared->tree, src->flat ? src->flat->flags : 0, errstr) != 0) {
+        mrb_r3_shared_release(shared);
+        return NULL;
+    }
+
+    // route entries may have moved while inserting, index them at the end
+    r3_tree_each_route(shared->tree, mrb_r3_index_route, shared->routes);
+
+    return shared;
+}
+
+static void
+mrb_r3_shared_publish(mrb_r3_shared *shared)
+{
+    mrb_r3_shared **it, *old = NULL;
+
+    mrb_r3_lock(&mrb_r3_shared_lock);
+
+    for (it = &mrb_r3_shared_list; *it; it = &(*it)->next) {
+        if (strcmp((*it)->name, shared->name) == 0) {
+            old = *it;
+            *it = old->next;
+            break;
+        }
+    }
+
+    shared->next       = mrb_r3_shared_list;
+    mrb_r3_shared_list = shared;
+
+    mrb_r3_unlock(&mrb_r3_shared_lock);
+
+    if (old) mrb_r3_shared_release(old);
+}
+
+static mrb_r3_shared *
+mrb_r3_shared_lookup(const char *name, mrb_bool unlink)
+{
+    mrb_r3_shared **it, *shared = NULL;
+
+    mrb_r3_lock(&mrb_r3_shared_lock);
+
+    for (it = &mrb_r3_shared_list; *it; it = &(*it)->next) {
+        if (strcmp((*it)->name, name) == 0) {
+            shared = *it;
+            break;
+        }
+    }
+
+    if (shared && unlink) {
+        *it = shared->next;
+    } else if (shared) {
+        mrb_r3_atomic_inc(&shared->refs);
+    }
+
+    mrb_r3_unlock(&mrb_r3_shared_lock);
+
+    return shared;
+}
+
+static mrb_value
+mrb_r3_f_share(mrb_state *mrb, mrb_value self)
+{
+    const char *name;
+    char *err = NULL;
+    R3Node *tree = mrb_r3_tree_ptr(mrb, self);
+    mrb_r3_shared *shared;
+
+    mrb_get_args(mrb, "z", &name);
+
+    if (!tree)
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Tree has been freed.");
+
+    shared = mrb_r3_shared_new(name, tree, &err);
+
+    if (!shared)
+        mrb_r3_raise_err(mrb, E_RUNTIME_ERROR, err);
+
+    mrb_r3_shared_publish(shared);
+
+    return self;
+}
+
+static mrb_value
+mrb_r3_f_attach(mrb_state *mrb, mrb_value self)
+{
+    const char *name;
+    mrb_r3_shared *shared;
+    mrb_value tree;
+
+    mrb_get_args(mrb, "z", &name);
+
+    shared = mrb_r3_shared_lookup(name, FALSE);
+
+    if (!shared)
+        return mrb_nil_value();
+
+    tree = mrb_obj_value(mrb_data_object_alloc(mrb, mrb_class_ptr(self), shared, &mrb_r3_shared_type));
+
+    mrb_iv_set(mrb, tree, mrb_intern_lit(mrb, "@data"), mrb_ary_new_capa(mrb, shared->routes_size));
+    mrb_r3_local_init(mrb, tree);
+
+    return tree;
+}
+
+static mrb_value
+mrb_r3_f_release(mrb_state *mrb, mrb_value self)
+{
+    const char *name;
+    mrb_r3_shared *shared;
+
+    (void)self;
+
+    mrb_get_args(mrb, "z", &name);
+
+    shared = mrb_r3_shared_lookup(name, TRUE);
+
+    if (!shared)
+        return mrb_false_value();
+
+    mrb_r3_shared_release(shared);
+
+    return mrb_true_value();
+}
+
+static mrb_value
+mrb_r3_f_bind(mrb_state *mrb, mrb_value self)
+{
+    mrb_int path_len, method = 0;
+    const char *path;
+    mrb_r3_shared *shared = DATA_PTR(self);
+    mrb_value data = mrb_nil_value();
+    mrb_bool data_given;
+    mrb_value conds[MRB_R3_CONDS];
+    mrb_sym names[MRB_R3_CONDS];
+    mrb_kwargs kw;
+    r3_iovec_t host = r3_iovec_init(NULL, 0);
+    unsigned int i;
+
+    mrb_r3_conds_init(mrb, &kw, names, conds);
+    mrb_get_args(mrb, "s|io?:", &path, &path_len, &method, &data, &data_given, &kw);
+
+    if (mrb_r3_cond_str(mrb, conds[MRB_R3_HOST]))
+        host = r3_iovec_init(RSTRING_PTR(conds[MRB_R3_HOST]), RSTRING_LEN(conds[MRB_R3_HOST]));
+
+    if (!shared)
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Tree has been freed.");
+
+    if (path_len > 1 && path[path_len - 1] == '/')
+        path_len -= 1;
+
+    for (i = 0; i < shared->routes_size; i++) {
+        R3Route *route = shared->routes[i];
+
+        if (route->request_method != method || route->path.len != path_len)
+            continue;
+
+        if (strncmp(route->path.base, path, path_len) != 0)
+            continue;
+
+        if (route->host.len != host.len || (host.len && memcmp(route->host.base, host.base, host.len) != 0))
+            continue;
+
+        if (data_given) {
+            mrb_ary_set(mrb, mrb_r3_data_ary(mrb, self), i, data);
+        }
+
+        return mrb_nil_value();
+    }
+
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Route is not part of the shared tree.");
+    return mrb_nil_value();
+}
+
+static mrb_value
+mrb_r3_f_attached_compile(mrb_state *mrb, mrb_value self)
+{
+    (void)self;
+
+    mrb_get_args(mrb, "");
+
+    return mrb_fixnum_value(0);
+}
+
+static mrb_value
+mrb_r3_f_detach(mrb_state *mrb, mrb_value self)
+{
+    mrb_r3_shared *shared = DATA_PTR(self);
+
+    if (!shared)
+        return mrb_false_value();
+
+    mrb_r3_cache_clear(mrb, self);
+    mrb_r3_shared_release(shared);
+
+    DATA_PTR(self)  = NULL;
+    DATA_TYPE(self) = NULL;
+
+    return mrb_true_value();
+}
+
+static mrb_value
+mrb_r3_f_compiling(mrb_state *mrb, mrb_value self)
+{
+    mrb_value obj = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@build"));
+
+    if (mrb_nil_p(obj))
+        return mrb_false_value();
+
+    // pairs with the increment of the thread, its results are visible then
+    return mrb_bool_value(mrb_r3_atomic_get(&((mrb_r3_build *)DATA_PTR(obj))->done) ? FALSE : TRUE);
+}
+
+/**
+ * Promote the tree of other to self and free the old one. A shared tree
+ * is released instead, so it lives on as long as other mrb_states still
+ * match against it.
+ */
+static mrb_value
+mrb_r3_f_swap(mrb_state *mrb, mrb_value self)
+{
+    mrb_value other, data;
+    mrb_sym attr;
+    void *ptr;
+
+    mrb_get_args(mrb, "o", &other);
+
+    if (mrb_type(other) != MRB_TT_DATA)
+        mrb_raise(mrb, E_TYPE_ERROR, "Trees must be of the same kind.");
+
+    if (!mrb_r3_tree_ptr(mrb, self) || !mrb_r3_tree_ptr(mrb, other))
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Tree has been freed.");
+
+    if (DATA_TYPE(other) != DATA_TYPE(self))
+        mrb_raise(mrb, E_TYPE_ERROR, "Trees must be of the same kind.");
+
+    if (mrb_obj_equal(mrb, self, other))
+        return self;
+
+    ptr             = DATA_PTR(self);
+    DATA_PTR(self)  = DATA_PTR(other);
+    DATA_PTR(other) = ptr;
+
+    attr = mrb_intern_lit(mrb, "@data");
+    data = mrb_iv_get(mrb, self, attr);
+    mrb_iv_set(mrb, self, attr, mrb_iv_get(mrb, other, attr));
+    mrb_iv_set(mrb, other, attr, data);
+
+    mrb_r3_cache_clear(mrb, self);
+
+    if (DATA_TYPE(other) == &mrb_r3_shared_type) {
+        mrb_r3_f_detach(mrb, other);
+    } else {
+        mrb_r3_f_free(mrb, other);
+    }
+
+    return self;
+}
+
+static mrb_value
+mrb_r3_f_set_cache(mrb_state *mrb, mrb_value self)
+{
+    mrb_value size;
+    mrb_r3_local *local;
+
+    mrb_get_args(mrb, "o", &size);
+
+    if (!mrb_nil_p(size) && !mrb_fixnum_p(size))
+        mrb_raise(mrb, E_TYPE_ERROR, "Cache size must be an integer.");
+
+    if (!mrb_nil_p(size) && mrb_fixnum(size) < 0)
+        mrb_raise(mrb, E_RANGE_ERROR, "Cache size cannot be lower then zero.");
+
+    local = mrb_r3_local_init(mrb, self);
+
+    r3_cache_free(local->cache);
+    local->cache = NULL;
+
+    if (!mrb_nil_p(size) && mrb_fixnum(size) > 0)
+        local->cache = r3_cache_create((size_t)mrb_fixnum(size));
+
+    return size;
+}
+
+static mrb_value
+mrb_r3_f_cache_stats(mrb_state *mrb, mrb_value self)
+{
+    mrb_r3_local *local = mrb_r3_local_ptr(mrb, self);
+    R3Cache *cache = local ? local->cache : NULL;
+    mrb_value stats;
+
+    if (!cache)
+        return mrb_nil_value();
+
+    stats = mrb_hash_new_capa(mrb, 5);
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "hits")), mrb_fixnum_value((mrb_int)cache->hits));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "misses")), mrb_fixnum_value((mrb_int)cache->misses));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "entries")), mrb_fixnum_value((mrb_int)cache->entries));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "bytes")), mrb_fixnum_value((mrb_int)cache->size));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "capacity")), mrb_fixnum_value((mrb_int)cache->capacity));
+
+    return stats;
+}
+
+static mrb_value
+mrb_r3_f_filter_stats(mrb_state *mrb, mrb_value self)
+{
+    mrb_r3_local *local = mrb_r3_local_ptr(mrb, self);
+    mrb_value stats;
+
+    stats = mrb_hash_new_capa(mrb, 2);
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "lookups")), mrb_fixnum_value(local ? local->lookups : 0));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "rejects")), mrb_fixnum_value(local ? local->rejects : 0));
+
+    return stats;
+}
+
+static mrb_value
+mrb_r3_f_memory_stats(mrb_state *mrb, mrb_value self)
+{
+    R3Node *tree = mrb_r3_tree_ptr(mrb, self);
+    R3Arena *arena;
+    mrb_value stats;
+
+    if (!tree)
+        return mrb_nil_value();
+
+    arena = tree->arena;
+
+    stats = mrb_hash_new_capa(mrb, 5);
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "chunks")), mrb_fixnum_value((mrb_int)arena->chunks_len));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "bytes")), mrb_fixnum_value((mrb_int)arena->size));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "used")), mrb_fixnum_value((mrb_int)arena->used));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "peak")), mrb_fixnum_value((mrb_int)arena->peak));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "strings")), mrb_fixnum_value(arena->strings ? (mrb_int)arena->strings->bytes->used : 0));
+
+    return stats;
+}
+
 void
 mrb_mruby_r3_gem_init(mrb_state *mrb)
 {
-    struct RClass *r3, *tr;
+    struct RClass *r3, *tr, *st;
 
     r3 = mrb_define_module(mrb, "R3");
     mrb_define_const(mrb, r3, "ANY",     mrb_fixnum_value(0));
@@ -309,21 +1286,42 @@ mrb_mruby_r3_gem_init(mrb_state *mrb)
     mrb_define_const(mrb, r3, "PATCH",   mrb_fixnum_value(METHOD_PATCH));
     mrb_define_const(mrb, r3, "HEAD",    mrb_fixnum_value(METHOD_HEAD));
     mrb_define_const(mrb, r3, "OPTIONS", mrb_fixnum_value(METHOD_OPTIONS));
+    mrb_define_const(mrb, r3, "HTTP",    mrb_fixnum_value(SCHEME_HTTP));
+    mrb_define_const(mrb, r3, "HTTPS",   mrb_fixnum_value(SCHEME_HTTPS));
 
     tr = mrb_define_class_under(mrb, r3, "Tree", mrb->object_class);
     MRB_SET_INSTANCE_TT(tr, MRB_TT_DATA);
     mrb_define_method(mrb, tr, "initialize", mrb_r3_f_init, MRB_ARGS_OPT(1));
-    mrb_define_method(mrb, tr, "add",        mrb_r3_f_add, MRB_ARGS_ARG(1,2));
-    mrb_define_method(mrb, tr, "<<",         mrb_r3_f_add, MRB_ARGS_ARG(1,2));
-    mrb_define_method(mrb, tr, "compile",    mrb_r3_f_compile, MRB_ARGS_NONE());
-    mrb_define_method(mrb, tr, "match?",     mrb_r3_f_matches, MRB_ARGS_ARG(1,1));
-    mrb_define_method(mrb, tr, "mismatch?",  mrb_r3_f_mismatches, MRB_ARGS_ARG(1,1));
-    mrb_define_method(mrb, tr, "match",      mrb_r3_f_match, MRB_ARGS_ARG(1,1));
+    mrb_define_method(mrb, tr, "add",        mrb_r3_f_add, MRB_ARGS_ARG(1,2)|MRB_ARGS_KEY(3,0));
+    mrb_define_method(mrb, tr, "<<",         mrb_r3_f_add, MRB_ARGS_ARG(1,2)|MRB_ARGS_KEY(3,0));
+    mrb_define_method(mrb, tr, "delete",     mrb_r3_f_delete, MRB_ARGS_ARG(1,1));
+    mrb_define_method(mrb, tr, "compile",    mrb_r3_f_compile, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, tr, "compiling?", mrb_r3_f_compiling, MRB_ARGS_NONE());
+    mrb_define_method(mrb, tr, "swap!",      mrb_r3_f_swap, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, tr, "match?",     mrb_r3_f_matches, MRB_ARGS_ARG(1,1)|MRB_ARGS_KEY(3,0));
+    mrb_define_method(mrb, tr, "mismatch?",  mrb_r3_f_mismatches, MRB_ARGS_ARG(1,1)|MRB_ARGS_KEY(3,0));
+    mrb_define_method(mrb, tr, "match",      mrb_r3_f_match, MRB_ARGS_ARG(1,1)|MRB_ARGS_KEY(3,0));
+    mrb_define_method(mrb, tr, "routes",     mrb_r3_f_routes, MRB_ARGS_NONE());
     mrb_define_method(mrb, tr, "free",       mrb_r3_f_free, MRB_ARGS_NONE());
+    mrb_define_method(mrb, tr, "share",      mrb_r3_f_share, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, tr, "cache=",     mrb_r3_f_set_cache, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, tr, "cache_stats", mrb_r3_f_cache_stats, MRB_ARGS_NONE());
+    mrb_define_method(mrb, tr, "filter_stats", mrb_r3_f_filter_stats, MRB_ARGS_NONE());
+    mrb_define_method(mrb, tr, "memory_stats", mrb_r3_f_memory_stats, MRB_ARGS_NONE());
+
+    st = mrb_define_class_under(mrb, r3, "SharedTree", tr);
+    MRB_SET_INSTANCE_TT(st, MRB_TT_DATA);
+    mrb_undef_class_method(mrb, st, "new");
+    mrb_define_class_method(mrb, st, "attach",  mrb_r3_f_attach, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, st, "release", mrb_r3_f_release, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, st, "add",     mrb_r3_f_bind, MRB_ARGS_ARG(1,2)|MRB_ARGS_KEY(3,0));
+    mrb_define_method(mrb, st, "<<",      mrb_r3_f_bind, MRB_ARGS_ARG(1,2)|MRB_ARGS_KEY(3,0));
+    mrb_define_method(mrb, st, "compile", mrb_r3_f_attached_compile, MRB_ARGS_NONE());
+    mrb_define_method(mrb, st, "free",    mrb_r3_f_detach, MRB_ARGS_NONE());
 }
 
 void
 mrb_mruby_r3_gem_final(mrb_state *mrb)
 {
-
+    (void)mrb;
 }
@@ -0,0 +1,144 @@
+# MIT License
+#
+# Copyright (c) 2017 Sebastian Katzer
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+def shared_tree(name)
+  tree = R3::Tree.new(1)
+  yield tree if block_given?
+  tree.compile
+  tree.share(name)
+end
+
+assert 'R3::SharedTree' do
+  assert_kind_of Class, R3::SharedTree
+  assert_true R3::SharedTree < R3::Tree
+end
+
+assert 'R3::SharedTree.new' do
+  assert_raise(NoMethodError) { R3::SharedTree.new }
+end
+
+assert 'R3::Tree#share(str)' do
+  tree = R3::Tree.new(1)
+  assert_equal tree, tree.share('share')
+  assert_raise(ArgumentError) { tree.share }
+  assert_true R3::SharedTree.release('share')
+end
+
+assert 'R3::SharedTree.attach(str)' do
+  assert_nil R3::SharedTree.attach('unknown')
+
+  shared_tree('attach') { |t| t.add '/users/{id}', R3::GET }
+  tree = R3::SharedTree.attach('attach')
+
+  assert_kind_of R3::SharedTree, tree
+  assert_equal ['GET /users/{id}'], tree.routes
+  assert_true tree.match? '/users/1', R3::GET
+  assert_false tree.match? '/users/1', R3::POST
+  assert_equal({ id: '1' }, tree.match('/users/1'))
+
+  R3::SharedTree.release('attach')
+end
+
+assert 'R3::SharedTree.attach(str)', 'compiled like the source' do
+  tree = R3::Tree.new(1)
+  tree.add '/users/{id:\d+}', R3::GET
+  tree.add '/files{path:.*}', R3::GET
+  tree.compile(dfa: true)
+  tree.share('dfa')
+
+  tree = R3::SharedTree.attach('dfa')
+  assert_equal({ id: '1' }, tree.match('/users/1'))
+  assert_equal({ path: '/a/b' }, tree.match('/files/a/b'))
+  assert_nil tree.match('/users/a')
+
+  R3::SharedTree.release('dfa')
+end
+
+assert 'R3::SharedTree#add', 'binds data per tree' do
+  shared_tree('bind') { |t| t.add '/users/{id}', R3::GET, 'origin' }
+
+  tree1 = R3::SharedTree.attach('bind')
+  tree2 = R3::SharedTree.attach('bind')
+
+  tree1.add '/users/{id}', R3::GET, 'tree1'
+  assert_equal [{ id: '1' }, 'tree1'], tree1.match('/users/1')
+  assert_equal({ id: '1' }, tree2.match('/users/1'))
+
+  assert_raise(ArgumentError) { tree1.add '/users/{id}', R3::POST, 'x' }
+  assert_raise(ArgumentError) { tree1.add '/other' }
+
+  R3::SharedTree.release('bind')
+end
+
+assert 'R3::SharedTree#compile' do
+  shared_tree('compile') { |t| t << '/' }
+  assert_equal 0, R3::SharedTree.attach('compile').compile
+
+  R3::SharedTree.release('compile')
+end
+
+assert 'R3::SharedTree#delete' do
+  shared_tree('delete') { |t| t << '/route' }
+  tree = R3::SharedTree.attach('delete')
+
+  assert_raise(RuntimeError) { tree.delete '/route' }
+  assert_true tree.match? '/route'
+
+  R3::SharedTree.release('delete')
+end
+
+assert 'R3::SharedTree#swap!' do
+  shared_tree('gen1') { |t| t << '/v1' }
+  shared_tree('gen2') { |t| t << '/v2' }
+
+  tree = R3::SharedTree.attach('gen1')
+  R3::SharedTree.release('gen1')
+
+  tree.swap! R3::SharedTree.attach('gen2')
+  assert_true  tree.match? '/v2'
+  assert_false tree.match? '/v1'
+  assert_raise(TypeError) { tree.swap! R3::Tree.new }
+
+  R3::SharedTree.release('gen2')
+end
+
+assert 'R3::SharedTree.release(str)' do
+  shared_tree('release') { |t| t << '/route' }
+  tree = R3::SharedTree.attach('release')
+
+  assert_true  R3::SharedTree.release('release')
+  assert_false R3::SharedTree.release('release')
+  assert_nil   R3::SharedTree.attach('release')
+  assert_true  tree.match? '/route'
+end
+
+assert 'R3::SharedTree#free' do
+  shared_tree('free') { |t| t << '/route' }
+  tree = R3::SharedTree.attach('free')
+
+  assert_true  tree.free
+  assert_false tree.free
+  assert_true  tree.routes.empty?
+  assert_true  R3::SharedTree.attach('free').match? '/route'
+
+  R3::SharedTree.release('free')
+end
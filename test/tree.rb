@@ -31,10 +31,6 @@ def setup_tree
   tree
 end
 
-def compiled_with_pcre?
-  Object.const_defined? :Regexp
-end
-
 assert 'R3::Tree' do
   assert_kind_of Class, R3::Tree
 end
@@ -88,6 +84,33 @@ assert 'R3::Tree#add(str, int, int, int)' do
   assert_raise(ArgumentError) { tree.add('/route', R3::GET, 1, 1) }
 end
 
+assert 'R3::Tree#add(str)', 'invalid pattern' do
+  tree = R3::Tree.new(1)
+
+  assert_raise(ArgumentError) { tree.add('/users/{id', R3::GET, 'x', host: 'x.com') }
+  assert_raise(ArgumentError) { tree.add('/users/{id', R3::GET, scheme: R3::HTTPS) }
+  assert_raise(ArgumentError) { tree.add('/users/{id', R3::GET, remote_addr: '10.0.0.1') }
+  assert_true tree.routes.empty?
+
+  tree.add('/users/{id}', R3::GET, 'user', host: 'x.com')
+  tree.compile
+
+  assert_equal [{ id: '1' }, 'user'], tree.match('/users/1', R3::GET, host: 'x.com')
+end
+
+assert 'R3::Tree#add(str)', 'copies the path' do
+  tree = R3::Tree.new(1)
+  path = '/users/{id}'
+
+  tree.add(path, R3::GET, 'user')
+  path.replace('/other/{xy}')
+  tree.compile
+
+  assert_equal [{ id: '1' }, 'user'], tree.match('/users/1')
+  assert_nil tree.match('/other/1')
+  assert_equal ['GET /users/{id}'], tree.routes
+end
+
 assert 'R3::Tree#compile()' do
   tree = R3::Tree.new(1)
 
@@ -101,6 +124,75 @@ assert 'R3::Tree#compile(int)' do
   assert_raise(ArgumentError) { tree.compile(1) }
 end
 
+assert 'R3::Tree#compile(hash)' do
+  tree = R3::Tree.new(1)
+
+  tree.add('/user',            R3::ANY, 'user')
+  tree.add('/user/{id:\d+}',   R3::ANY, 'id')
+  tree.add('/user/{name}',     R3::ANY, 'name')
+  tree.add('/files/{path:.*}', R3::ANY, 'files')
+
+  assert_kind_of Integer, tree.compile(dfa: true)
+  assert_equal [{}, 'user'], tree.match('/user')
+  assert_equal [{ id: '1' }, 'id'], tree.match('/user/1')
+  assert_equal [{ name: 'a1' }, 'name'], tree.match('/user/a1')
+  assert_equal [{ path: 'a/b' }, 'files'], tree.match('/files/a/b')
+  assert_nil tree.match('/other')
+end
+
+assert 'R3::Tree#compile(hash)', 'jit' do
+  tree = setup_tree { |t| t.add('/post/{year:\d{4}}', R3::ANY, 'year') }
+
+  assert_kind_of Integer, tree.compile(jit: true)
+  assert_equal [{ year: '2020' }, 'year'], tree.match('/post/2020')
+  assert_nil tree.match('/post/20201')
+end
+
+assert 'R3::Tree#compile(hash)', 'background' do
+  tree = R3::Tree.new(1)
+  tree.add('/user/{id:\d+}', R3::ANY, 'id')
+
+  assert_nil tree.compile(background: true)
+  assert_equal [{ id: '1' }, 'id'], tree.match('/user/1')
+  assert_false tree.compiling?
+end
+
+assert 'R3::Tree#compile()', 'again after add' do
+  tree = setup_tree { |t| t.add('/user/{id:\d+}', R3::ANY, 'id') }
+
+  tree.add('/user/{name:[a-z]+}',    R3::ANY, 'name')
+  tree.add('/user/{id:\d+}/{post}',  R3::ANY, 'post')
+  assert_kind_of Integer, tree.compile
+  assert_equal [{ id: '1' }, 'id'], tree.match('/user/1')
+  assert_equal [{ name: 'ab' }, 'name'], tree.match('/user/ab')
+  assert_equal [{ id: '1', post: 'p' }, 'post'], tree.match('/user/1/p')
+end
+
+assert 'R3::Tree#match(str)', 'static routes added after compile' do
+  tree = setup_tree do |t|
+    t.add('/a',            R3::ANY, 'a')
+    t.add('/u/{id}/posts', R3::ANY, 'posts')
+  end
+
+  tree.add('/b',    R3::ANY, 'b')
+  tree.add('/u/me', R3::ANY, 'me')
+  assert_equal [{}, 'a'], tree.match('/a')
+  assert_equal [{}, 'b'], tree.match('/b')
+  assert_equal [{}, 'me'], tree.match('/u/me')
+  assert_equal [{ id: '1' }, 'posts'], tree.match('/u/1/posts')
+end
+
+assert 'R3::Tree#compile()', 'thousands of edges' do
+  tree = R3::Tree.new(1)
+
+  1000.times { |i| tree.add("/v/{id:x#{i}y[a-z]+}", R3::ANY, i) }
+  1000.times { |i| tree.add("/v/s#{i}/{id}", R3::ANY, i) }
+  assert_kind_of Integer, tree.compile
+  assert_equal [{ id: 'x999yab' }, 999], tree.match('/v/x999yab')
+  assert_equal [{ id: '1' }, 999], tree.match('/v/s999/1')
+  assert_nil tree.match('/v/x1000yab')
+end
+
 assert 'R3::Tree#match?(str)' do
   assert_true  setup_tree { |t| t << '/route' }.match? '/route'
   assert_true  setup_tree { |t| t << '/route' }.match? '/route/'
@@ -196,12 +288,10 @@ assert 'R3::Tree#match(str, int)' do
   assert_kind_of Hash, params
   assert_true params.empty?
 
-  if compiled_with_pcre?
-    params = tree.match('/user/bernd', R3::GET)
-    assert_equal 1, params.size
-    assert_include params, :name
-    assert_equal 'bernd', params[:name]
-  end
+  params = tree.match('/user/bernd', R3::GET)
+  assert_equal 1, params.size
+  assert_include params, :name
+  assert_equal 'bernd', params[:name]
 
   params = tree.match('/user/bernd', R3::DELETE)
   assert_nil params
@@ -224,6 +314,159 @@ assert 'R3::Tree#match(str)', 'return params and data' do
   assert_kind_of Proc, handler
 end
 
+assert 'R3::Tree#match(str)', 'falls back to sibling routes' do
+  tree = setup_tree do |t|
+    t.add('/user/{id:\d+}/edit', R3::ANY, 'edit')
+    t.add('/user/{name}/show',   R3::ANY, 'show')
+    t.add('/user/new/form',      R3::ANY, 'form')
+    t.add('/page/{name}',        R3::ANY, 'name')
+    t.add('/page/{id:\d+}',      R3::ANY, 'id')
+  end
+
+  assert_equal [{ id: '1' }, 'edit'], tree.match('/user/1/edit')
+  assert_equal [{ name: '1' }, 'show'], tree.match('/user/1/show')
+  assert_equal [{ name: 'new' }, 'show'], tree.match('/user/new/show')
+  assert_equal [{}, 'form'], tree.match('/user/new/form')
+  assert_equal [{ id: '1' }, 'id'], tree.match('/page/1')
+  assert_equal [{ name: 'a' }, 'name'], tree.match('/page/a')
+end
+
+assert 'R3::Tree#match(str, int)', 'falls back to routes of the method' do
+  tree = setup_tree do |t|
+    t.add('/user/{id:\d+}',      R3::GET,  'show')
+    t.add('/user/{name}',        R3::POST, 'create')
+    t.add('/user/{id:\d+}/edit', R3::GET,  'edit')
+  end
+
+  assert_equal [{ id: '1' }, 'show'], tree.match('/user/1', R3::GET)
+  assert_equal [{ name: '1' }, 'create'], tree.match('/user/1', R3::POST)
+  assert_nil tree.match('/user/1', R3::DELETE)
+  assert_nil tree.match('/user/1/edit', R3::POST)
+end
+
+assert 'R3::Tree#match(str, int)', 'static routes' do
+  tree = setup_tree do |t|
+    t.add('/health',          R3::GET,  'health')
+    t.add('/login',           R3::GET,  'form')
+    t.add('/login',           R3::POST, 'login')
+    t.add('/api/v1/status',   R3::ANY,  'status')
+    t.add('/api/v1/{name}',   R3::ANY,  'name')
+    t.add('/files',           R3::ANY,  'files')
+    t.add('/files{path:.*}',  R3::ANY,  'path')
+  end
+
+  assert_equal [{}, 'health'], tree.match('/health', R3::GET)
+  assert_nil tree.match('/health', R3::POST)
+  assert_equal [{}, 'form'], tree.match('/login', R3::GET)
+  assert_equal [{}, 'login'], tree.match('/login', R3::POST)
+  assert_equal [{}, 'status'], tree.match('/api/v1/status')
+  assert_equal [{ name: 'stats' }, 'name'], tree.match('/api/v1/stats')
+  assert_equal [{ path: '/x' }, 'path'], tree.match('/files/x')
+end
+
+assert 'R3::Tree#match(str)', 'catch-all comes after the static route' do
+  [%w[/files /files{path:.*}], %w[/files{path:.*} /files]].each do |paths|
+    [{}, { dfa: true }].each do |opts|
+      tree = R3::Tree.new(1)
+      paths.each { |path| tree.add(path, R3::ANY, path) }
+      tree.compile(opts)
+
+      assert_equal [{}, '/files'], tree.match('/files')
+      assert_equal [{ path: '/x' }, '/files{path:.*}'], tree.match('/files/x')
+    end
+  end
+end
+
+assert 'R3::Tree#match(str)', 'slug patterns' do
+  tree = setup_tree do |t|
+    t.add('/post/{year:\d{4}}',               R3::ANY, 'year')
+    t.add('/file/{name:[a-z]+\.(?:png|jpg)}', R3::ANY, 'file')
+    t.add('/blog/{year}/{slug}',              R3::ANY, 'blog')
+  end
+
+  assert_equal [{ year: '2020' }, 'year'], tree.match('/post/2020')
+  assert_nil tree.match('/post/20201')
+  assert_equal [{ name: 'cat.png' }, 'file'], tree.match('/file/cat.png')
+  assert_nil tree.match('/file/cat.gif')
+  assert_equal [{ year: '2020', slug: 'hi' }, 'blog'], tree.match('/blog/2020/hi')
+end
+
+assert 'R3::Tree#match(str)', 'id formats' do
+  uuid = '[0-9a-f]{8}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{12}'
+
+  tree = setup_tree do |t|
+    t.add("/uuid/{id:#{uuid}}",          R3::ANY, 'uuid')
+    t.add('/oid/{id:[0-9a-f]{24}}',      R3::ANY, 'oid')
+    t.add('/num/{id:\d{1,10}}/{name}',   R3::ANY, 'num')
+    t.add('/slug/{id:[A-Za-z0-9_-]+}',   R3::ANY, 'slug')
+  end
+
+  id = '0f8fad5b-d9cb-469f-a165-70867728950e'
+  assert_equal [{ id: id }, 'uuid'], tree.match("/uuid/#{id}")
+  assert_nil tree.match("/uuid/#{id.upcase}")
+  assert_equal [{ id: '5f0c' * 6 }, 'oid'], tree.match("/oid/#{'5f0c' * 6}")
+  assert_nil tree.match("/oid/#{'5f0c' * 5}")
+  assert_equal [{ id: '42', name: 'x' }, 'num'], tree.match('/num/42/x')
+  assert_nil tree.match('/num/12345678901/x')
+  assert_equal [{ id: 'a-B_1' }, 'slug'], tree.match('/slug/a-B_1')
+end
+
+assert 'R3::Tree#match(str, int, host:)' do
+  tree = setup_tree do |t|
+    t.add('/', R3::GET, 'api', host: 'api.example.com')
+    t.add('/', R3::GET, 'sub', host: '*.example.com')
+    t.add('/', R3::GET, 'any')
+  end
+
+  assert_equal [{}, 'api'], tree.match('/', R3::GET, host: 'api.example.com')
+  assert_equal [{}, 'sub'], tree.match('/', R3::GET, host: 'www.example.com')
+  assert_equal [{}, 'any'], tree.match('/', R3::GET, host: 'example.com')
+  assert_equal [{}, 'any'], tree.match('/', R3::GET, host: 'example.org')
+  assert_true tree.match?('/', host: 'example.org')
+end
+
+assert 'R3::Tree#match(str, int, scheme:)' do
+  tree = setup_tree do |t|
+    t.add('/login', R3::ANY, 'form', scheme: R3::HTTPS)
+    t.add('/login', R3::ANY, 'redirect')
+  end
+
+  assert_equal [{}, 'form'], tree.match('/login', scheme: R3::HTTPS)
+  assert_equal [{}, 'redirect'], tree.match('/login', scheme: R3::HTTP)
+  assert_equal [{}, 'redirect'], tree.match('/login')
+end
+
+assert 'R3::Tree#match(str, int, remote_addr:)' do
+  tree = setup_tree do |t|
+    t.add('/admin', R3::ANY, 'lan',   remote_addr: '10.0.0.0/8')
+    t.add('/admin', R3::ANY, 'local', remote_addr: '::1')
+    t.add('/admin', R3::ANY, 'v6',    remote_addr: '2001:db8::/32')
+  end
+
+  assert_equal [{}, 'lan'], tree.match('/admin', remote_addr: '10.1.2.3')
+  assert_equal [{}, 'local'], tree.match('/admin', remote_addr: '::1')
+  assert_equal [{}, 'v6'], tree.match('/admin', remote_addr: '2001:db8::1')
+  assert_nil tree.match('/admin', remote_addr: '192.168.0.1')
+  assert_nil tree.match('/admin')
+  assert_true tree.mismatch?('/admin', remote_addr: '11.0.0.1')
+end
+
+assert 'R3::Tree#match(str, int, host:)', 'wrong type' do
+  tree = setup_tree { |t| t.add('/admin', R3::ANY, 'admin') }
+
+  assert_raise(TypeError) { tree.match('/admin', host: 1) }
+  assert_raise(TypeError) { tree.match?('/admin', scheme: 'https') }
+  assert_raise(TypeError) { tree.match('/admin', remote_addr: :lan) }
+  assert_equal [{}, 'admin'], tree.match('/admin')
+end
+
+assert 'R3::Tree#add(str, int, obj, remote_addr:)' do
+  assert_raise(ArgumentError) { tree.add('/', R3::ANY, nil, remote_addr: 'localhost') }
+  assert_raise(ArgumentError) { tree.add('/', R3::ANY, nil, remote_addr: '10.0.0.0/33') }
+  assert_raise(ArgumentError) { tree.add('/', R3::ANY, nil, remote_addr: '10.0.0.0/') }
+  assert_raise(TypeError) { tree.add('/', R3::ANY, nil, host: 1) }
+end
+
 assert 'R3::Tree#match', 'chomp does not modify string' do
   route = '/user/'
   copy  = route.dup
@@ -252,11 +495,131 @@ assert 'R3::Tree#match(str, int, int)' do
   assert_raise(ArgumentError) { setup_tree.match '/', 1, 1 }
 end
 
+assert 'R3::Tree#cache=' do
+  tree = setup_tree do |t|
+    t.add('/user/{name}', R3::GET, 'user')
+    t.add('/user/{id:\d+}', R3::GET, 'id')
+  end
+
+  assert_nil tree.cache_stats
+  tree.cache = 4096
+
+  assert_equal [{ name: 'a' }, 'user'], tree.match('/user/a', R3::GET)
+  assert_equal [{ name: 'a' }, 'user'], tree.match('/user/a', R3::GET)
+  assert_nil tree.match('/user/a', R3::POST)
+  assert_nil tree.match('/other', R3::GET)
+  assert_true tree.match?('/user/1', R3::GET)
+  assert_equal [{ id: '1' }, 'id'], tree.match('/user/1', R3::GET)
+
+  stats = tree.cache_stats
+  assert_equal 2, stats[:hits]
+  assert_equal 4, stats[:misses]
+  assert_equal 4, stats[:entries]
+  assert_equal 4096, stats[:capacity]
+
+  tree.add('/other', R3::GET, 'other')
+  tree.compile
+  assert_equal 0, tree.cache_stats[:entries]
+  assert_equal [{}, 'other'], tree.match('/other', R3::GET)
+
+  tree.cache = nil
+  assert_nil tree.cache_stats
+  assert_raise(RangeError) { tree.cache = -1 }
+  assert_raise(TypeError) { tree.cache = '1' }
+end
+
+assert 'R3::Tree#filter_stats' do
+  tree = setup_tree do |t|
+    t.add('/user/{id:\d+}', R3::GET, 'user')
+    t.add('/api/v1/{name}',  R3::GET, 'api')
+  end
+
+  assert_equal({ lookups: 0, rejects: 0 }, tree.filter_stats)
+
+  assert_equal [{ id: '1' }, 'user'], tree.match('/user/1')
+  assert_nil tree.match('/wp-admin/setup.php')
+  assert_nil tree.match('/.env')
+  assert_nil tree.match('/user/a')
+
+  assert_equal({ lookups: 4, rejects: 2 }, tree.filter_stats)
+
+  tree.cache = 4096
+  assert_equal [:@data], tree.instance_variables
+end
+
+assert 'R3::Tree#memory_stats' do
+  tree  = R3::Tree.new(1)
+  stats = tree.memory_stats
+
+  assert_equal 1, stats[:chunks]
+  assert_true stats[:bytes] >= stats[:used]
+
+  100.times { |i| tree.add("/users/#{i}/{id}") }
+  grown = tree.memory_stats
+  assert_true grown[:used] > stats[:used]
+  assert_true grown[:peak] >= grown[:used]
+  assert_true grown[:strings] > stats[:strings]
+
+  tree.delete('/users/1/{id}')
+  assert_true tree.memory_stats[:used] < grown[:used]
+  assert_equal grown[:peak], tree.memory_stats[:peak]
+
+  tree.add('/users/1/{id}', R3::POST)
+  assert_equal grown[:strings], tree.memory_stats[:strings]
+
+  tree.free
+  assert_nil tree.memory_stats
+end
+
+assert 'R3::Tree#delete' do
+  tree = setup_tree do |t|
+    t.add('/user/list',      R3::GET, 'list')
+    t.add('/user/{id:\d+}',  R3::GET, 'id')
+    t.add('/user/{id:\d+}',  R3::POST, 'update')
+  end
+
+  assert_true  tree.delete('/user/{id:\d+}/', R3::GET)
+  assert_false tree.delete('/user/{id:\d+}', R3::GET)
+  assert_false tree.delete('/user/list')
+  assert_equal ['GET /user/list', 'POST /user/{id:\d+}'], tree.routes
+
+  assert_nil tree.match('/user/1', R3::GET)
+  assert_equal [{ id: '1' }, 'update'], tree.match('/user/1', R3::POST)
+  assert_equal [{}, 'list'], tree.match('/user/list', R3::GET)
+
+  assert_true tree.delete('/user/list', R3::GET)
+  assert_nil  tree.match('/user/list', R3::GET)
+
+  tree.free
+  assert_raise(RuntimeError) { tree.delete('/user/list', R3::GET) }
+end
+
+assert 'R3::Tree#swap!' do
+  tree = setup_tree { |t| t.add('/old', R3::ANY, 'old') }
+  gen  = R3::Tree.new(1)
+
+  gen.add('/new', R3::ANY, 'new')
+  gen.compile(background: true)
+
+  assert_equal tree, tree.swap!(gen)
+  assert_equal [{}, 'new'], tree.match('/new')
+  assert_nil tree.match('/old')
+  assert_equal ['ANY /new'], tree.routes
+  assert_false gen.free
+
+  assert_raise(RuntimeError) { tree.swap!(gen) }
+  assert_raise(TypeError) { tree.swap!(1) }
+end
+
 assert 'R3::Tree#free' do
   tree = setup_tree
 
   assert_true  tree.free
   assert_false tree.free
+  assert_raise(RuntimeError) { tree.compile }
+  assert_raise(RuntimeError) { tree.compile(background: true) }
+  assert_raise(RuntimeError) { tree.match('/') }
+  assert_raise(RuntimeError) { tree.match?('/') }
 end
 
 assert 'R3::Tree#routes' do
@@ -276,3 +639,15 @@ assert 'R3::Tree#routes' do
   tree.free
   assert_true tree.routes.empty?
 end
+
+assert 'R3::Tree#routes', 'in the order of adding' do
+  tree = R3::Tree.new(1)
+
+  tree.add '/users/{id}', R3::GET
+  tree.add '/about', R3::ANY
+  tree.add '/users/{id}', R3::POST
+  tree.add '/users', R3::GET
+  tree.delete '/about'
+
+  assert_equal ['GET /users/{id}', 'POST /users/{id}', 'GET /users'], tree.routes
+end